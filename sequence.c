@@ -15,35 +15,535 @@
  *
  */
 
+#include "config.h"
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <locale.h>
+#include <regex.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/statvfs.h>
+
+#ifdef HAVE_SYS_PIDFD_H
+#include <sys/pidfd.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_LINUX_MAGIC_H
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #define SYSLOG_NAMES 1
 #include <syslog.h>
 
-#include "config.h"
-
 #define READ_FD 0
 #define WRITE_FD 1
 
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+typedef struct record_t {
+    char *name;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int code;
+} record_t;
+
+typedef struct sequence_t {
+    const char *name;
+    int ignore;
+    int slog;
+    int facility;
+    int level;
+    int stages;
+    int depends;
+    int keepgoing;
+    int backend;
+    int summary;
+    int raw;
+    int format;
+    int sort;
+    size_t jobs;
+    long long timeout;
+    long long total;
+    long long grace;
+    sigset_t mask;
+    int foreground;
+    const char *checkpoint;
+    int resume;
+    int checkpointfd;
+    int dirty;
+    record_t *records;
+    size_t nrecords;
+    const char *cache;
+    int cachefd;
+    long long ttl;
+    size_t cachesize;
+    const char **cacheenv;
+    size_t ncacheenv;
+    const char *manifest;
+    const char *manifestname;
+    int manifestfd;
+    int pipesize;
+    int pipemax;
+    const char *logsocket;
+    int logformat;
+    int logfd;
+    long long logretry;
+    struct logq_t *logq;
+    long logdropped;
+    long long logsent;
+    int journald;
+    char runid[33];
+    char hostname[256];
+    struct rlimit nofile;
+    int nofileraised;
+    int output;
+    int timestamps;
+    int collapse;
+    long ratelines;
+    long ratebytes;
+    long totallines;
+    long totalbytes;
+    struct bucket_t *bucket;
+    int multiline;
+    regex_t *starts;
+    size_t nstarts;
+    long long idle;
+    size_t recordsize;
+    char *out;
+    size_t outlen;
+    size_t outsize;
+} sequence_t;
+
+/*
+ * The head of a directory manifest, followed by the sorted names, each
+ * ending in a zero. The manifest describes the directory as long as the
+ * directory itself is unchanged.
+ */
+typedef struct manifest_t {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t options;
+    uint64_t count;
+    uint64_t size;
+    uint64_t sum;
+} manifest_t;
+
+#define MANIFEST_MAGIC "seqman1"
+
+/* the first line of each cache file, followed by the cached stderr */
+#define CACHE_MAGIC "sequence-cache-1"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* the return code when we gave up waiting, as timeout(1) does */
+#define EXIT_TIMEOUT 124
+
+#define NANOSECONDS 1000000000LL
+
+#define SPAWN_FORK 0
+#define SPAWN_CLONE 1
+
+#define SUMMARY_TABLE 0
+#define SUMMARY_TSV 1
+
+#define SORT_BYTES 0
+#define SORT_NATURAL 1
+#define SORT_VERSION 2
+#define SORT_LOCALE 3
+
+/* how much of the directory we ask the kernel for at a time */
+#define SCAN_SIZE (256 * 1024)
+
+/* how much of a child's stderr we read at a time, at first */
+#define RELAY_SIZE (64 * 1024)
+
+/* how far we grow a pipe when we cannot find out the system limit */
+#define PIPE_MAX_SIZE (1024 * 1024)
+
+/* the longest line we hold on to before passing it on regardless */
+#define RELAY_LINE (1024 * 1024)
+
+/* how many pieces of lines we gather into each write */
+#define RELAY_IOV 64
+
+#define SYSLOG_SOCKET "/dev/log"
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+#define SYSLOG_RFC3164 0
+#define SYSLOG_RFC5424 1
+
+/* how often we try to reach a syslog that is not there yet */
+#define SYSLOG_RETRY (NANOSECONDS / 4)
+
+/* how soon we look again at a syslog that is not keeping up */
+#define SYSLOG_BACKOFF (NANOSECONDS / 100)
+
+/*
+ * How many lines we hold on to while syslog is not keeping up, and how
+ * many before we stop reading more. A single read from a full pipe can
+ * hold many thousands of short lines.
+ */
+#define SYSLOG_QUEUE (64 * 1024)
+#define SYSLOG_PAUSE 1024
+
+/* the longest syslog header or set of journal fields we make */
+#define SYSLOG_HEADER 1024
+
+#define TIMESTAMPS_NONE 0
+#define TIMESTAMPS_MONO 1
+#define TIMESTAMPS_REAL 2
+#define TIMESTAMPS_DELTA 3
+
+#define OUTPUT_TEXT 0
+#define OUTPUT_NDJSON 1
+#define OUTPUT_FRAMES 2
+
+/* how long a record may wait for more lines, and how long it may get */
+#define MULTILINE_IDLE (NANOSECONDS / 2)
+#define MULTILINE_SIZE (64 * 1024)
+
+/* the kinds of record in ndjson and frames output */
+#define EVENT_LINE 1
+#define EVENT_SPAWN 2
+#define EVENT_EXIT 3
+#define EVENT_ERROR 4
+#define EVENT_SEQUENCE 5
+
+/* the most the fixed fields of a record may take up */
+#define OUTPUT_FIELDS 512
+
+/*
+ * Lines that syslog could not take yet, oldest first.
+ */
+typedef struct logq_t {
+    char *msg[SYSLOG_QUEUE];
+    size_t len[SYSLOG_QUEUE];
+    size_t head;
+    size_t count;
+} logq_t;
+
+/*
+ * Descriptors kept free of the executables we open ahead of time, for
+ * epoll, the signalfd, the log socket, the checkpoint and the cache, and
+ * for the pipes and pidfd of each child that runs at the same time.
+ */
+#define TABLE_RESERVE 64
+#define TABLE_RESERVE_JOB 6
+
+/* how many events we take from epoll at a time */
+#define EPOLL_EVENTS 64
+
+/* epoll tokens, the child slot shifted up, and what the fd is */
+#define TOKEN_PIPE 0
+#define TOKEN_PIDFD 1
+#define TOKEN_STDOUT 2
+#define TOKEN_SHIFT 2
+#define TOKEN_MASK 3
+#define TOKEN_SIGNAL (~(uint64_t)0)
+#define TOKEN_SYSLOG (~(uint64_t)1)
+
+/* the stack our vfork style children use until they exec */
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+/* how many checks of executables we have in flight at a time */
+#define PROBE_RING 256
+#define PROBE_THREADS 16
+
+#if defined(HAVE_EXECVEAT) || defined(SYS_execveat)
+#define HAVE_EXEC_FD 1
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_STATX) && \
+        defined(SYS_io_uring_setup) && defined(SYS_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+
+#define ENTRY_WAITING 0
+#define ENTRY_RUNNING 1
+#define ENTRY_DONE 2
+#define ENTRY_FAILED 3
+/* once the run is over, waiting on something that failed */
+#define ENTRY_BLOCKED 4
+
+/* how much of each executable we search for dependency headers */
+#define HEADER_SIZE 4096
+
+typedef struct entry_t {
+    char *provides;
+    char *requires;
+    char *wants;
+    size_t *after;
+    size_t nafter;
+    int declared;
+    int state;
+} entry_t;
+
+/* the smallest block the arena takes from malloc at a time */
+#define ARENA_BLOCK (64 * 1024)
+
+typedef struct block_t {
+    struct block_t *next;
+    size_t used;
+    size_t size;
+    char data[];
+} block_t;
+
+typedef struct arena_t {
+    block_t *blocks;
+} arena_t;
+
+/*
+ * An entry in the directory. The first eight bytes of the name are held
+ * inline as a big endian number, so that most comparisons while sorting
+ * never leave the table.
+ */
+typedef struct name_t {
+    uint64_t key;
+    const char *name;
+    char *path;
+    const char *collate;
+    size_t len;
+    int fd;
+} name_t;
+
+typedef struct table_t {
+    arena_t arena;
+    name_t *names;
+    size_t count;
+    size_t size;
+} table_t;
+
+/*
+ * What we learned about an executable while listing with -p -i.
+ */
+typedef struct probe_t {
+    int error;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+} probe_t;
+
+typedef struct prober_t {
+    int dfd;
+    name_t *names;
+    probe_t *probes;
+    size_t count;
+    size_t next;
+} prober_t;
+
+typedef struct dirent64_t {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} dirent64_t;
+
+/*
+ * A token bucket, holding up to a second's worth of lines and bytes.
+ */
+typedef struct bucket_t {
+    double lines;
+    double bytes;
+    long long refilled;
+} bucket_t;
+
+typedef struct child_t {
+    char *path;
+    size_t index;
+    pid_t pid;
+    int pidfd;
+    int fd;
+    int outfd;
+    int reaped;
+    int status;
+    int error;
+    int timedout;
+    long long deadline;
+    long long latency;
+    long long started;
+    long long exited;
+    struct rusage usage;
+    struct stat st;
+    uint64_t key;
+    int cacheable;
+    char *capture;
+    size_t captured;
+    char *partial;
+    size_t partiallen;
+    size_t partialsize;
+    int pipesize;
+    long blocked;
+    char *last;
+    size_t lastlen;
+    size_t lastsize;
+    long repeats;
+    long dropped;
+    long long droppedbytes;
+    bucket_t bucket;
+    char *record;
+    size_t recordstart;
+    size_t recordlen;
+    size_t recordsize;
+    int recordopen;
+    long long recorded;
+} child_t;
+
+typedef struct spawn_t {
+    const char *file;
+    int exec;
+    char **args;
+    sigset_t mask;
+    const struct rlimit *nofile;
+    int fd;
+    int outfd;
+    int status;
+    int pgroup;
+    int foreground;
+    int error;
+} spawn_t;
+
+typedef struct result_t {
+    int ran;
+    int code;
+    long long latency;
+    long long wall;
+    long blocked;
+    struct rusage usage;
+} result_t;
+
+typedef struct run_t {
+    const char *dirname;
+    name_t *names;
+    char **args;
+    size_t count;
+    entry_t *entries;
+    result_t *results;
+    child_t *children;
+    int epfd;
+    int sigfd;
+    size_t running;
+    size_t next;
+    size_t stage;
+    size_t failed;
+    long long deadline;
+    int expired;
+    int paused;
+    int logfd;
+    int result;
+    char *buf;
+    size_t bufsize;
+} run_t;
+
+enum {
+    OPT_SPAWN = 256,
+    OPT_TIMEOUT,
+    OPT_TOTAL_TIMEOUT,
+    OPT_KILL_AFTER,
+    OPT_SUMMARY_FORMAT,
+    OPT_CHECKPOINT,
+    OPT_RESUME,
+    OPT_CACHE,
+    OPT_CACHE_TTL,
+    OPT_CACHE_SIZE,
+    OPT_CACHE_ENV,
+    OPT_SORT,
+    OPT_MANIFEST,
+    OPT_RAW,
+    OPT_PIPE_SIZE,
+    OPT_SYSLOG_SOCKET,
+    OPT_SYSLOG_FORMAT,
+    OPT_JOURNAL,
+    OPT_OUTPUT_FORMAT,
+    OPT_TIMESTAMPS,
+    OPT_RATE_LIMIT,
+    OPT_TOTAL_RATE_LIMIT,
+    OPT_COLLAPSE,
+    OPT_MULTILINE,
+    OPT_MULTILINE_START,
+    OPT_MULTILINE_IDLE,
+    OPT_MULTILINE_SIZE
+};
+
 static struct option long_options[] =
 {
     {"zero", no_argument, NULL, '0'},
     {"base", required_argument, NULL, 'b'},
+    {"depends", no_argument, NULL, 'd'},
     {"ignore", no_argument, NULL, 'i'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"keep-going", no_argument, NULL, 'k'},
     {"print", no_argument, NULL, 'p'},
+    {"stages", no_argument, NULL, 'S'},
     {"syslog", required_argument, NULL, 's'},
+    {"syslog-socket", required_argument, NULL, OPT_SYSLOG_SOCKET},
+    {"syslog-format", required_argument, NULL, OPT_SYSLOG_FORMAT},
+    {"journal", required_argument, NULL, OPT_JOURNAL},
+    {"spawn", required_argument, NULL, OPT_SPAWN},
+    {"timeout", required_argument, NULL, OPT_TIMEOUT},
+    {"total-timeout", required_argument, NULL, OPT_TOTAL_TIMEOUT},
+    {"kill-after", required_argument, NULL, OPT_KILL_AFTER},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"resume", no_argument, NULL, OPT_RESUME},
+    {"cache", required_argument, NULL, OPT_CACHE},
+    {"cache-ttl", required_argument, NULL, OPT_CACHE_TTL},
+    {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+    {"cache-env", required_argument, NULL, OPT_CACHE_ENV},
+    {"sort", required_argument, NULL, OPT_SORT},
+    {"manifest", required_argument, NULL, OPT_MANIFEST},
+    {"raw", no_argument, NULL, OPT_RAW},
+    {"pipe-size", required_argument, NULL, OPT_PIPE_SIZE},
+    {"output-format", required_argument, NULL, OPT_OUTPUT_FORMAT},
+    {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+    {"total-rate-limit", required_argument, NULL, OPT_TOTAL_RATE_LIMIT},
+    {"collapse", no_argument, NULL, OPT_COLLAPSE},
+    {"multiline", no_argument, NULL, OPT_MULTILINE},
+    {"multiline-start", required_argument, NULL, OPT_MULTILINE_START},
+    {"multiline-idle", required_argument, NULL, OPT_MULTILINE_IDLE},
+    {"multiline-size", required_argument, NULL, OPT_MULTILINE_SIZE},
+    {"timestamps", required_argument, NULL, OPT_TIMESTAMPS},
+    {"summary", no_argument, NULL, 't'},
+    {"summary-format", required_argument, NULL, OPT_SUMMARY_FORMAT},
     {"help", no_argument, NULL, 'h'},
     {"version", no_argument, NULL, 'v'},
     {NULL, 0, NULL, 0}
@@ -68,7 +568,7 @@ static int help(const char *name, const char *msg, int code)
             "  %s - Run all executables in a directory in sequence.\n"
             "\n"
             "SYNOPSIS\n"
-            "  %s [-0] [-b dir] [-i] [-p] [-s facility.level] [-v] [-h] directory [options]\n"
+            "  %s [-0] [-b dir] [-d] [-i] [-j jobs] [-k] [-p] [-S] [-s facility.level] [-t] [-v] [-h] directory [options]\n"
             "\n"
             "DESCRIPTION\n"
             "\n"
@@ -86,13 +586,135 @@ static int help(const char *name, const char *msg, int code)
             "\n"
             "  -b, --base dir    Directory is relative to this base directory.\n"
             "\n"
+            "  -d, --depends Run each executable as soon as the executables it\n"
+            "                depends on have succeeded. See the note below.\n"
+            "\n"
             "  -i, --ignore  Ignore non executable files. See the note below.\n"
             "\n"
+            "  -j, --jobs jobs  Run up to this many executables at the same time,\n"
+            "                   started in alphabetical order. Defaults to 1, or\n"
+            "                   no limit with --stages or --depends.\n"
+            "\n"
+            "  -k, --keep-going  Keep running executables after an executable\n"
+            "                    fails, and list the failures at the end.\n"
+            "\n"
             "  -p, --print   Print the name of executables rather than execute.\n"
             "\n"
+            "  -S, --stages  Run executables whose names start with the same number\n"
+            "                at the same time, waiting for each stage to finish\n"
+            "                before the next stage is started.\n"
+            "\n"
             "  -s, --syslog [facility.]level Send stderr to syslog at the given facility\n"
             "                                and level. Example: user.info\n"
             "\n"
+            "  --journal [facility.]level  Send stderr to the systemd journal\n"
+            "                        at the given facility and level, with\n"
+            "                        fields naming the executable and the run.\n"
+            "                        See the note below.\n"
+            "\n"
+            "  --syslog-socket path  Send lines for syslog or the journal to this\n"
+            "                        socket. Defaults to /dev/log, or to\n"
+            "                        /run/systemd/journal/socket with --journal.\n"
+            "\n"
+            "  --syslog-format rfc3164|rfc5424  Send lines for syslog in\n"
+            "                        the traditional format, or the format\n"
+            "                        of RFC5424. Defaults to rfc3164.\n"
+            "\n"
+            "  -t, --summary Print a summary of each executable run once all\n"
+            "                executables are done, giving the time taken to\n"
+            "                spawn, the wall clock, user and system time, the\n"
+            "                maximum resident set size, the major and minor\n"
+            "                page faults, the voluntary and involuntary context\n"
+            "                switches, how often stderr was full, and the\n"
+            "                return code.\n"
+            "\n"
+            "  --summary-format table|tsv  Print the summary as a table, or as\n"
+            "                              tab separated values with a header\n"
+            "                              line. Defaults to table.\n"
+            "\n"
+            "  --spawn clone|fork  Start executables with a vfork style clone, or\n"
+            "                      with a traditional fork. Defaults to clone where\n"
+            "                      available.\n"
+            "\n"
+            "  --timeout seconds  Stop each executable that runs for longer than\n"
+            "                     this. See the note below.\n"
+            "\n"
+            "  --total-timeout seconds  Stop all executables once the run as a\n"
+            "                           whole has taken longer than this.\n"
+            "\n"
+            "  --kill-after seconds  After a timeout, wait this long for the\n"
+            "                        executable to stop before killing it.\n"
+            "                        Defaults to 5 seconds.\n"
+            "\n"
+            "  --checkpoint file  Record the outcome of each executable in this\n"
+            "                     file as the run progresses. See the note below.\n"
+            "\n"
+            "  --resume  Skip the executables that succeeded in the run recorded\n"
+            "            in the checkpoint file, and start at those that did not.\n"
+            "\n"
+            "  --cache dir  Replay the stderr and return code of an earlier run\n"
+            "               of an executable from this directory instead of\n"
+            "               running it again. See the note below.\n"
+            "\n"
+            "  --cache-ttl seconds  How long a cached result may be replayed.\n"
+            "                       Defaults to 3600 seconds.\n"
+            "\n"
+            "  --cache-size bytes  The most the cache directory may hold.\n"
+            "                      Defaults to 1048576 bytes.\n"
+            "\n"
+            "  --cache-env name  Include this environment variable in the cache\n"
+            "                    key. May be given more than once.\n"
+            "\n"
+            "  --sort bytes|natural|version|locale  Order executables by the\n"
+            "                   bytes of their names, with numbers compared by\n"
+            "                   value, as versions, or by the collation order\n"
+            "                   of the locale. Defaults to bytes.\n"
+            "\n"
+            "  --manifest file  Keep the sorted list of executables in this\n"
+            "                   file, and skip reading the directory while\n"
+            "                   it is unchanged. See the note below.\n"
+            "\n"
+            "  --raw  Let executables write to our stderr directly, without\n"
+            "         the name of the executable in front of each line.\n"
+            "\n"
+            "  --pipe-size bytes  The size of the pipe each executable writes\n"
+            "                     stderr to. Defaults to growing the pipe of an\n"
+            "                     executable that keeps it full.\n"
+            "\n"
+            "  --timestamps mono|real|delta  Put the time each line was read\n"
+            "                     in front of it, as seconds since boot, the\n"
+            "                     date and time, or seconds since the executable\n"
+            "                     was started. See the note below.\n"
+            "\n"
+            "  --rate-limit lines[,bytes]  Pass on no more than this many lines\n"
+            "                     and bytes a second from each executable,\n"
+            "                     dropping the rest. See the note below.\n"
+            "\n"
+            "  --total-rate-limit lines[,bytes]  Pass on no more than this\n"
+            "                     many lines and bytes a second from all\n"
+            "                     executables together.\n"
+            "\n"
+            "  --collapse  Pass on a line repeated by an executable once, followed\n"
+            "               by how many times it was repeated.\n"
+            "\n"
+            "  --multiline  Fold lines that are indented into the line before,\n"
+            "                passing them on as one record. See the note below.\n"
+            "\n"
+            "  --multiline-start regex  Fold every line that does not match\n"
+            "                     this extended regular expression into the line\n"
+            "                     before. May be given more than once.\n"
+            "\n"
+            "  --multiline-idle seconds  Pass on a record once the executable\n"
+            "                     has been quiet for this long. Defaults to 0.5\n"
+            "                     seconds.\n"
+            "\n"
+            "  --multiline-size bytes  Start a new record rather than grow a\n"
+            "                     record past this size. Defaults to 65536 bytes.\n"
+            "\n"
+            "  --output-format text|ndjson|frames  Write stderr as lines of text,\n"
+            "                   as JSON records one per line, or as binary\n"
+            "                   frames. See the note below.\n"
+            "\n"
             "  -h, --help    Display this help message.\n"
             "\n"
             "  -v, --version Display the version number.\n"
@@ -107,6 +729,19 @@ static int help(const char *name, const char *msg, int code)
             "  If the executable could not be executed, or if the options\n"
             "  are invalid, the status 1 is returned.\n"
             "\n"
+            "  When more than one job is allowed, no further executables are\n"
+            "  started once an executable fails, and the executables already\n"
+            "  running are waited for. If more than one executable fails, the\n"
+            "  return code is from the failed executable first alphabetically.\n"
+            "\n"
+            "  With -k, every executable is run, and the return code is from the\n"
+            "  failed executable first alphabetically. With -d, executables that\n"
+            "  depend on a failed executable are not run.\n"
+            "\n"
+            "  If an executable was stopped because it ran out of time, the\n"
+            "  return code is 124. If the run as a whole ran out of time, the\n"
+            "  status 124 is returned.\n"
+            "\n"
             "NOTES\n"
             "  When non executable files are ignored with the -i option, sequence will\n"
             "  ignore the EACCESS result code when trying to execute the file and move\n"
@@ -117,6 +752,109 @@ static int help(const char *name, const char *msg, int code)
             "  to take care using this information to ensure that race conditions and\n"
             "  additional restrictions like selinux do not negatively affect the outcome.\n"
             "\n"
+            "  On a network filesystem the checks for all executables are made at\n"
+            "  once, and are worked out from the mode and owner of each file, so that\n"
+            "  access control lists are not taken into account.\n"
+            "\n"
+            "  Each executable is opened before the first is run, and the file that\n"
+            "  was opened is the file that is run, even if it is renamed or replaced in\n"
+            "  the meantime. Scripts are run by name, and a script that has been\n"
+            "  replaced since it was opened is not run.\n"
+            "\n"
+            "  With --journal, each line is sent to the journal as a record of its\n"
+            "  own. The record carries the fields SYSLOG_IDENTIFIER and SYSLOG_PID\n"
+            "  naming the executable and its process, SEQUENCE_SCRIPT holding the name\n"
+            "  of the executable within the directory, SEQUENCE_RUN_ID holding an id\n"
+            "  shared by all the lines of the same run, and PRIORITY and\n"
+            "  SYSLOG_FACILITY. Records too large for the socket are handed to the\n"
+            "  journal in a sealed memfd.\n"
+            "\n"
+            "  With --output-format ndjson or frames, each line of stderr becomes a\n"
+            "  record giving the type 'line', the monotonic time in nanoseconds, the\n"
+            "  name of the executable, its process id, the stream and the line itself.\n"
+            "  A 'spawn' record follows the start of each executable, an 'exit' record\n"
+            "  gives the return code, the signal if any, and the wall clock, user and\n"
+            "  system time in nanoseconds along with the resource usage, and an 'error'\n"
+            "  record gives the reason an executable could not be run. Messages from\n"
+            "  sequence about the run as a whole become 'sequence' records, with an\n"
+            "  empty name and the process id of sequence. Bytes that are not valid\n"
+            "  UTF-8 are escaped as if they were Latin-1. Each frame starts with its\n"
+            "  length in four bytes, followed by one byte for the type (1 line, 2\n"
+            "  spawn, 3 exit, 4 error, 5 sequence), one for the stream, two for the\n"
+            "  length of the name, four for the process id and eight for the time,\n"
+            "  then the name and the line or message. An exit frame ends with the\n"
+            "  return code and signal in four bytes each, and the times, usage and\n"
+            "  lines dropped in eight bytes each. All numbers are big endian.\n"
+            "\n"
+            "  With --timestamps, the clock is read once for each batch of lines taken\n"
+            "  from an executable, so lines read together share a time. The time is\n"
+            "  written in front of the name of the executable, or in front of the\n"
+            "  message sent to syslog. With rfc5424 and real time, the time is given\n"
+            "  in the syslog header instead, and with --journal the time is sent in\n"
+            "  the field SEQUENCE_TIMESTAMP. With --output-format, the time of each\n"
+            "  record is given in nanoseconds on the clock asked for.\n"
+            "\n"
+            "  Rate limits are kept in token buckets holding up to a second's worth\n"
+            "  of lines and bytes, and a limit of zero lines or bytes is no limit.\n"
+            "  Lines over the limit are dropped while their executable keeps running\n"
+            "  and is never made to wait. Once an executable has finished, the number\n"
+            "  of lines and bytes dropped is passed on in its name, or given in the\n"
+            "  exit record with --output-format. With --collapse, repeated lines are\n"
+            "  dropped before the rate limits are applied, and followed by the\n"
+            "  line 'last message repeated N times'.\n"
+            "\n"
+            "  With --multiline or --multiline-start, a stack trace or other message\n"
+            "  spread over many lines is sent to syslog or the journal as a single\n"
+            "  message, and written as a single record with --output-format. Lines\n"
+            "  written to stderr keep the name of the executable in front of each\n"
+            "  line. A record is held until a line arrives that starts the next\n"
+            "  record, so the last line written by an executable is passed on once\n"
+            "  the executable has been quiet for the idle time, or has finished.\n"
+            "\n"
+            "  With the -d option, the first 4096 bytes of each executable are searched\n"
+            "  for a comment line of the form '# sequence-after: name [name ...]', or\n"
+            "  for an LSB 'BEGIN INIT INFO' block containing Provides, Required-Start\n"
+            "  and Should-Start lines. Each name is the name of another executable in\n"
+            "  the directory, or a name given in Provides. LSB facilities beginning\n"
+            "  with '$' are ignored. An executable without either header waits for the\n"
+            "  executables without headers sorted before it, so that these run one after\n"
+            "  another as they would without -d. Missing dependencies and dependency\n"
+            "  cycles are reported before anything is run.\n"
+            "\n"
+            "  When a timeout is given, each executable is run in a process group of\n"
+            "  its own. On timeout the process group is sent SIGTERM, and if anything\n"
+            "  in the group is still running after the kill-after period, SIGKILL.\n"
+            "  SIGINT, SIGTERM and SIGHUP sent to sequence are passed on to each\n"
+            "  process group before sequence exits. With one job at a time, each\n"
+            "  executable is given the terminal while it runs, so that it may read\n"
+            "  from it.\n"
+            "\n"
+            "  The checkpoint file holds a line for each executable that finished,\n"
+            "  giving its return code, device, inode, modification time and name. An\n"
+            "  executable is only skipped on resume if it is unchanged since it last\n"
+            "  succeeded. The file is emptied once every executable has succeeded,\n"
+            "  and without --resume each run starts a new file.\n"
+            "\n"
+            "  The cache is keyed on a hash of the contents, owner and permissions of\n"
+            "  the executable, its arguments and the environment variables named with\n"
+            "  --cache-env. Only executables that exit by themselves are cached, and\n"
+            "  only those that can be read. A cached result is only replayed for an\n"
+            "  executable we are still allowed to run, so that an executable that has\n"
+            "  lost its execute permission fails or is ignored as it would without the\n"
+            "  cache. The cache should only be used for executables whose\n"
+            "  output depends on nothing else. Only stderr is cached, so an\n"
+            "  executable that writes to stdout is never cached, and while an\n"
+            "  executable may still be cached its stdout is passed on through a\n"
+            "  pipe.\n"
+            "\n"
+            "  The manifest is used only when the device, inode, modification and\n"
+            "  change times of the directory match those recorded, and when the\n"
+            "  filtering and sort order asked for are unchanged. Otherwise the\n"
+            "  directory is read and sorted, and a new manifest is written. A\n"
+            "  directory changed within the last two seconds is not recorded, as\n"
+            "  the times may not yet show the change. Changes made behind symbolic\n"
+            "  links in the directory are not noticed.\n"
+            "\n"
             "EXAMPLES\n"
             "  In this basic example, we execute all commands in /etc/rc3.d, passing\n"
             "  the parameter 'start' to each command.\n"
@@ -128,6 +866,16 @@ static int help(const char *name, const char *msg, int code)
             "\n"
             "\t~$ sequence -s cron.info -b /etc cron.d\n"
             "\n"
+            "  Here, we run the commands in /etc/cron.hourly with up to four\n"
+            "  commands running at the same time.\n"
+            "\n"
+            "\t~$ sequence -j 4 /etc/cron.hourly\n"
+            "\n"
+            "  Here, we start 10-net and 10-dns together, and once both have\n"
+            "  finished, we start 20-app and 20-cache together.\n"
+            "\n"
+            "\t~$ sequence -S /etc/rc3.d -- start\n"
+            "\n"
             "AUTHOR\n"
             "  Graham Leggett <minfrin@sharp.fm>\n"
             "", msg ? msg : "", n, n);
@@ -140,399 +888,5668 @@ static int version()
     return 0;
 }
 
-static int
-sort_strcmp(const void *p1, const void *p2)
+/*
+ * Take memory from the arena, which is only ever given back all at once.
+ */
+static void *arena_alloc(arena_t *arena, size_t len)
 {
-    return strcmp(*(const char **) p1, *(const char **) p2);
-}
+    block_t *b = arena->blocks;
 
-static int syslog_decode(const char *name, const CODE *codetab)
-{
-    const CODE *c;
+    void *p;
 
-    for (c = codetab; c->c_name; c++) {
-        if (!strcasecmp(name, c->c_name)) {
-            return (c->c_val);
+    len = (len + 7) & ~(size_t)7;
+
+    if (!b || b->size - b->used < len) {
+
+        size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+
+        b = malloc(sizeof(block_t) + size);
+        if (!b) {
+            return NULL;
         }
+
+        b->next = arena->blocks;
+        b->used = 0;
+        b->size = size;
+
+        arena->blocks = b;
     }
 
-    return -1;
+    p = b->data + b->used;
+    b->used += len;
+
+    return p;
 }
 
-static char *syslog_details(const char *name, const CODE *codetab)
+static void arena_free(arena_t *arena)
 {
-    const CODE *c;
+    while (arena->blocks) {
+        block_t *b = arena->blocks;
+        arena->blocks = b->next;
+        free(b);
+    }
+}
 
-    size_t len = 0;
+/*
+ * Add a name to the table. The joined path and the name share the same
+ * memory in the arena, the name being the tail of the path.
+ */
+static int table_add(table_t *table, const char *dirname, size_t dirlen,
+        const char *name)
+{
+    size_t len = strlen(name), i;
 
-    char *buf, *s;
+    name_t *n;
 
-    for (c = codetab; c->c_name; c++) {
-        len += strlen(c->c_name);
-        len++;
-    }
+    char *path;
 
-    buf = s = malloc(len + 1);
-    if (!buf) {
-        return NULL;
-    }
+    if (table->size <= table->count) {
 
-    for (c = codetab; c->c_name; c++) {
-        if (c != codetab) {
-            strncpy(s, ",", 1);
-            s++;
+        size_t size = table->size ? table->size * 2 : 64;
+
+        n = realloc(table->names, size * sizeof(name_t));
+        if (!n) {
+            return -1;
         }
-        size_t l = strlen(c->c_name);
-        strncpy(s, c->c_name, l);
-        s += l;
+
+        table->names = n;
+        table->size = size;
     }
 
-    *s = 0;
+    path = arena_alloc(&table->arena, dirlen + len + 2);
+    if (!path) {
+        return -1;
+    }
 
-    return buf;
+    memcpy(path, dirname, dirlen);
+    path[dirlen] = '/';
+    memcpy(path + dirlen + 1, name, len + 1);
+
+    n = &table->names[table->count++];
+
+    n->path = path;
+    n->name = path + dirlen + 1;
+    n->len = len;
+    n->collate = NULL;
+    n->fd = -1;
+    n->key = 0;
+
+    for (i = 0; i < 8; i++) {
+        n->key = (n->key << 8) | (i < len ? (unsigned char)name[i] : 0);
+    }
+
+    return 0;
 }
 
-int main (int argc, char **argv)
+/*
+ * Open each executable with O_PATH, so that what we run is what we
+ * listed, however the directory changes while we run. Should we run out
+ * of descriptors, the remaining executables are run by name.
+ */
+static void table_open(sequence_t *seq, table_t *table, int dfd)
 {
-    const char *name = argv[0];
-    const char *basename = NULL;
-    const char *dirname;
-    int c, status = 0, zero = 0, ignore = 0, print = 0, slog = 0, bfd, dfd;
+#ifdef HAVE_EXEC_FD
+    struct rlimit rl;
 
-    int facility = 0, level = 0;
+    rlim_t want, reserve;
 
-    DIR *dh;
-    struct dirent *de;
+    size_t i;
 
-    size_t size = 16, count = 0, i, dirlen;
+    if (getrlimit(RLIMIT_NOFILE, &rl)) {
+        return;
+    }
 
-    const char **names = malloc(sizeof(const char *) * size);
+    reserve = TABLE_RESERVE + TABLE_RESERVE_JOB *
+            (seq->jobs < table->count ? seq->jobs : table->count);
+    want = table->count + reserve;
 
-    while ((c = getopt_long(argc, argv, "0b:ips:hv", long_options, NULL)) != -1) {
+    /* raise the limit as far as we need, our children get the old one */
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < want &&
+            rl.rlim_cur < rl.rlim_max) {
 
-        switch (c)
-        {
-        case '0':
-            zero = 1;
+        seq->nofile = rl;
+        seq->nofileraised = 1;
 
-            break;
-        case 'b':
-            basename = optarg;
+        rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || want < rl.rlim_max ?
+                want : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl)) {
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
 
-            break;
-        case 'i':
-            ignore = 1;
+    for (i = 0; i < table->count; i++) {
 
-            break;
-        case 'p':
-            print = 1;
+        name_t *n = &table->names[i];
+
+        n->fd = openat(dfd, n->name, O_PATH | O_CLOEXEC);
 
+        /*
+         * Leave room for everything else we open while running. Names
+         * left without a descriptor are run by name.
+         */
+        if (n->fd != -1 && rl.rlim_cur != RLIM_INFINITY &&
+                n->fd + reserve >= rl.rlim_cur) {
+            close(n->fd);
+            n->fd = -1;
             break;
-        case 's': {
-            char *s;
+        }
+        if (n->fd == -1 && (errno == EMFILE || errno == ENFILE)) {
+            break;
+        }
+    }
+#endif
+}
 
-            s = strchr(optarg, '.');
-            if (s) {
-                *s = '\0';
+static void table_free(table_t *table)
+{
+    size_t i;
 
-                facility = syslog_decode(optarg, facilitynames);
-                if (facility < 0) {
-                    char *facilities = syslog_details(name, facilitynames);
-                    fprintf(stderr, "%s: Unknown facility '%s': %s\n",
-                            name, optarg, facilities);
-                    free(facilities);
-                    return EXIT_FAILURE;
-                }
+    for (i = 0; i < table->count; i++) {
+        if (table->names[i].fd != -1) {
+            close(table->names[i].fd);
+        }
+    }
 
-                optarg = ++s;
-            }
-            else {
-                facility = LOG_USER;
-            }
+    arena_free(&table->arena);
+    free(table->names);
+}
 
-            level = syslog_decode(optarg, prioritynames);
-            if (level < 0) {
-                char *priorities = syslog_details(name, prioritynames);
-                fprintf(stderr, "%s: Unknown priority %s: %s\n",
-                        name, optarg, priorities);
-                free(priorities);
-                return EXIT_FAILURE;
-            }
+static int name_cmp(const void *p1, const void *p2)
+{
+    const name_t *n1 = p1, *n2 = p2;
 
-            slog = 1;
+    return strcmp(n1->name, n2->name);
+}
 
-            break;
-        }
-        case 'h':
-            return help(name, NULL, 0);
+/*
+ * Compare names with runs of digits compared by their value, so that
+ * 2-foo comes before 10-bar. Leading zeros are skipped, and names that
+ * differ only in their leading zeros are left to the tie break.
+ */
+static int natural_cmp(const char *s1, const char *s2)
+{
+    while (*s1 && *s2) {
 
-        case 'v':
-            return version();
+        if (*s1 >= '0' && *s1 <= '9' && *s2 >= '0' && *s2 <= '9') {
 
-        default:
-            return help(name, NULL, EXIT_FAILURE);
+            size_t l1, l2;
+            int c;
 
-        }
+            while (*s1 == '0') {
+                s1++;
+            }
+            while (*s2 == '0') {
+                s2++;
+            }
 
-    }
+            for (l1 = 0; s1[l1] >= '0' && s1[l1] <= '9'; l1++);
+            for (l2 = 0; s2[l2] >= '0' && s2[l2] <= '9'; l2++);
 
-    if (optind == argc) {
-        fprintf(stderr, "%s: No directory specified.\n", name);
-        return EXIT_FAILURE;
-    }
+            if (l1 != l2) {
+                return l1 < l2 ? -1 : 1;
+            }
 
-    if (basename) {
+            c = memcmp(s1, s2, l1);
+            if (c) {
+                return c;
+            }
 
-        bfd = open(basename, O_RDONLY);
-        if (bfd == -1) {
-            fprintf(stderr, "%s: Could not open '%s': %s\n", name,
-                    basename, strerror(errno));
-            return EXIT_FAILURE;
+            s1 += l1;
+            s2 += l2;
+
+            continue;
         }
 
-        if (fchdir(bfd) == -1) {
-            fprintf(stderr, "%s: Could not chdir to '%s': %s\n", name,
-                    basename, strerror(errno));
-            return EXIT_FAILURE;
+        if (*s1 != *s2) {
+            break;
         }
+
+        s1++;
+        s2++;
     }
 
-    dirname = argv[optind];
-    dirlen = strlen(dirname);
+    return (unsigned char)*s1 - (unsigned char)*s2;
+}
 
-    dfd = open(dirname, O_RDONLY);
-    if (dfd == -1) {
-        fprintf(stderr, "%s: Could not open '%s': %s\n", name,
+static int natural_name_cmp(const void *p1, const void *p2)
+{
+    const name_t *n1 = p1, *n2 = p2;
+
+    int c = natural_cmp(n1->name, n2->name);
+
+    return c ? c : strcmp(n1->name, n2->name);
+}
+
+#ifdef HAVE_STRVERSCMP
+static int version_name_cmp(const void *p1, const void *p2)
+{
+    const name_t *n1 = p1, *n2 = p2;
+
+    int c = strverscmp(n1->name, n2->name);
+
+    return c ? c : strcmp(n1->name, n2->name);
+}
+#endif
+
+static int locale_name_cmp(const void *p1, const void *p2)
+{
+    const name_t *n1 = p1, *n2 = p2;
+
+    int c = strcmp(n1->collate, n2->collate);
+
+    return c ? c : strcmp(n1->name, n2->name);
+}
+
+/*
+ * Sort the table into byte order.
+ *
+ * A radix sort on the inline keys does almost all the work, one byte at
+ * a time starting from the least significant, skipping bytes that are
+ * the same across all names. Only names whose first eight bytes are
+ * equal are then compared in full.
+ */
+static int table_radix(table_t *table)
+{
+    name_t *names = table->names, *tmp, *swap;
+
+    size_t count = table->count, i, start;
+
+    int shift;
+
+    if (count < 2) {
+        return 0;
+    }
+
+    tmp = malloc(count * sizeof(name_t));
+    if (!tmp) {
+        return -1;
+    }
+
+    for (shift = 0; shift < 64; shift += 8) {
+
+        size_t buckets[256] = { 0 }, pos = 0;
+
+        int b;
+
+        for (i = 0; i < count; i++) {
+            buckets[(names[i].key >> shift) & 0xff]++;
+        }
+
+        /* every name has the same byte here, nothing to do */
+        if (buckets[(names[0].key >> shift) & 0xff] == count) {
+            continue;
+        }
+
+        for (b = 0; b < 256; b++) {
+            size_t n = buckets[b];
+            buckets[b] = pos;
+            pos += n;
+        }
+
+        for (i = 0; i < count; i++) {
+            tmp[buckets[(names[i].key >> shift) & 0xff]++] = names[i];
+        }
+
+        swap = names;
+        names = tmp;
+        tmp = swap;
+    }
+
+    /* the sorted names may have ended up in the scratch space */
+    if (names != table->names) {
+        memcpy(table->names, names, count * sizeof(name_t));
+        tmp = names;
+    }
+    names = table->names;
+
+    free(tmp);
+
+    /* settle the ties */
+    for (start = 0; start < count; start = i) {
+
+        for (i = start + 1; i < count && names[i].key == names[start].key; i++);
+
+        if (i - start > 1) {
+            qsort(names + start, i - start, sizeof(name_t), name_cmp);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sort the table in the order asked for.
+ *
+ * In locale order, the collation key of each name is worked out once up
+ * front with strxfrm(), leaving the sort itself to compare bytes.
+ */
+static int table_sort(table_t *table, int sort)
+{
+    size_t i;
+
+    switch (sort) {
+    case SORT_NATURAL:
+        qsort(table->names, table->count, sizeof(name_t), natural_name_cmp);
+        break;
+    case SORT_VERSION:
+#ifdef HAVE_STRVERSCMP
+        qsort(table->names, table->count, sizeof(name_t), version_name_cmp);
+#else
+        qsort(table->names, table->count, sizeof(name_t), natural_name_cmp);
+#endif
+        break;
+    case SORT_LOCALE:
+        for (i = 0; i < table->count; i++) {
+
+            name_t *n = &table->names[i];
+
+            size_t len = strxfrm(NULL, n->name, 0);
+
+            char *collate = arena_alloc(&table->arena, len + 1);
+            if (!collate) {
+                return -1;
+            }
+
+            strxfrm(collate, n->name, len + 1);
+
+            n->collate = collate;
+        }
+        qsort(table->names, table->count, sizeof(name_t), locale_name_cmp);
+        break;
+    default:
+        return table_radix(table);
+    }
+
+    return 0;
+}
+
+static int syslog_decode(const char *name, const CODE *codetab)
+{
+    const CODE *c;
+
+    for (c = codetab; c->c_name; c++) {
+        if (!strcasecmp(name, c->c_name)) {
+            return (c->c_val);
+        }
+    }
+
+    return -1;
+}
+
+static char *syslog_details(const char *name, const CODE *codetab)
+{
+    const CODE *c;
+
+    size_t len = 0;
+
+    char *buf, *s;
+
+    for (c = codetab; c->c_name; c++) {
+        len += strlen(c->c_name);
+        len++;
+    }
+
+    buf = s = malloc(len + 1);
+    if (!buf) {
+        return NULL;
+    }
+
+    for (c = codetab; c->c_name; c++) {
+        if (c != codetab) {
+            strncpy(s, ",", 1);
+            s++;
+        }
+        size_t l = strlen(c->c_name);
+        strncpy(s, c->c_name, l);
+        s += l;
+    }
+
+    *s = 0;
+
+    return buf;
+}
+
+static uint64_t fnv(uint64_t h, const void *buf, size_t len)
+{
+    const unsigned char *b = buf;
+
+    while (len--) {
+        h ^= *b++;
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+/*
+ * The monotonic clock, in nanoseconds.
+ */
+static long long monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NANOSECONDS + ts.tv_nsec;
+}
+
+/*
+ * Lines on their way to stderr or syslog, gathered up so that they go
+ * out in as few writes as we can manage.
+ */
+typedef struct batch_t {
+    struct iovec iov[RELAY_IOV];
+    int count;
+    size_t len;
+    struct mmsghdr msgs[RELAY_IOV];
+    int nmsgs;
+    char header[SYSLOG_HEADER];
+    size_t headerlen;
+    long long now;
+    long long mono;
+    char stamp[64];
+    size_t stamplen;
+    char note[128];
+    unsigned char lens[RELAY_IOV][8];
+} batch_t;
+
+/*
+ * Connect to the syslog socket. The socket never blocks us, lines that
+ * syslog cannot take yet are queued instead.
+ */
+static int log_connect(sequence_t *seq)
+{
+    struct sockaddr_un sun = { 0 };
+
+    if (seq->logfd != -1) {
+        close(seq->logfd);
+    }
+
+    seq->logfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (seq->logfd == -1) {
+        return -1;
+    }
+
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, seq->logsocket, sizeof(sun.sun_path) - 1);
+
+    if (connect(seq->logfd, (struct sockaddr *)&sun, sizeof(sun))) {
+        close(seq->logfd);
+        seq->logfd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * While we have no connection to syslog, try again now and then, as
+ * syslog() would. Syslog may well start after we do.
+ */
+static void log_reconnect(sequence_t *seq)
+{
+    long long now;
+
+    if (seq->logfd != -1) {
+        return;
+    }
+
+    now = monotonic();
+
+    if (now >= seq->logretry) {
+        seq->logretry = now + SYSLOG_RETRY;
+        log_connect(seq);
+    }
+}
+
+/*
+ * A journal record too big for a datagram is written to a sealed memfd,
+ * and the memfd is sent instead.
+ */
+static int log_memfd(sequence_t *seq, const struct iovec *iov, int count)
+{
+#if defined(HAVE_MEMFD_CREATE) || defined(SYS_memfd_create)
+    union {
+        struct cmsghdr cmsg;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr m = { 0 };
+
+    struct cmsghdr *cmsg;
+
+    int fd, i, ok = 1;
+
+    if (!seq->journald) {
+        return -1;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("sequence-journal", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    fd = syscall(SYS_memfd_create, "sequence-journal",
+            MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+    if (fd == -1) {
+        return -1;
+    }
+
+    for (i = 0; ok && i < count; i++) {
+
+        const char *p = iov[i].iov_base;
+
+        size_t len = iov[i].iov_len;
+
+        while (len) {
+            ssize_t n = write(fd, p, len);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ok = 0;
+                break;
+            }
+            p += n;
+            len -= n;
+        }
+    }
+
+    if (!ok || fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&control, 0, sizeof(control));
+
+    m.msg_control = &control;
+    m.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&m);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while ((ok = sendmsg(seq->logfd, &m, 0)) == -1 && errno == EINTR);
+
+    close(fd);
+
+    return ok < 0 ? -1 : 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Send what has been queued. If asked to wait, as we are once the run is
+ * over, we give syslog up to a second to catch up, otherwise we go no
+ * further than it will take, and try again after SYSLOG_RETRY.
+ */
+static void log_flush(sequence_t *seq, int wait)
+{
+    logq_t *q = seq->logq;
+
+    long long deadline = wait ? monotonic() + NANOSECONDS : 0;
+
+    while (q && q->count) {
+
+        ssize_t n;
+
+        /* the lines wait in the queue until syslog turns up */
+        if (seq->logfd == -1) {
+
+            log_reconnect(seq);
+
+            if (seq->logfd == -1) {
+
+                if (!wait || monotonic() >= deadline) {
+                    return;
+                }
+
+                poll(NULL, 0, 10);
+
+                continue;
+            }
+        }
+
+        n = send(seq->logfd, q->msg[q->head], q->len[q->head], MSG_DONTWAIT);
+
+        if (n < 0) {
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            /* syslog went away, connect again when we can */
+            if (errno == ECONNREFUSED || errno == ENOTCONN) {
+                close(seq->logfd);
+                seq->logfd = -1;
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == ENOBUFS) {
+
+                struct pollfd pfd = { seq->logfd, POLLOUT, 0 };
+
+                /* the run goes on, the timer brings us back */
+                if (!wait) {
+                    seq->logretry = monotonic() + SYSLOG_BACKOFF;
+                    return;
+                }
+
+                if (monotonic() >= deadline) {
+                    return;
+                }
+
+                /* a full buffer does not always wake us, look again soon */
+                poll(&pfd, 1, 10);
+
+                continue;
+            }
+
+            if (errno == EMSGSIZE) {
+
+                struct iovec iov;
+
+                iov.iov_base = q->msg[q->head];
+                iov.iov_len = q->len[q->head];
+
+                n = log_memfd(seq, &iov, 1);
+            }
+        }
+
+        if (n < 0) {
+            seq->logdropped++;
+        }
+        else {
+            seq->logsent = monotonic();
+        }
+
+        free(q->msg[q->head]);
+        q->head = (q->head + 1) % SYSLOG_QUEUE;
+        q->count--;
+    }
+}
+
+/*
+ * Make up an id for this run, so that the journal can tell the lines of
+ * one run from those of another.
+ */
+static void log_runid(sequence_t *seq)
+{
+    unsigned char id[16];
+
+    size_t got = 0;
+
+    int fd, i;
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        ssize_t n;
+        while (got < sizeof(id) &&
+                ((n = read(fd, id + got, sizeof(id) - got)) > 0 ||
+                        (n < 0 && errno == EINTR))) {
+            got += n > 0 ? n : 0;
+        }
+        close(fd);
+    }
+
+    /* no randomness to be had, the time and our pid will have to do */
+    if (got < sizeof(id)) {
+        uint64_t h = fnv(FNV_OFFSET, &seq, sizeof(seq));
+        long long now = monotonic();
+        pid_t pid = getpid();
+
+        h = fnv(h, &now, sizeof(now));
+        h = fnv(h, &pid, sizeof(pid));
+        memcpy(id, &h, sizeof(h));
+        h = fnv(h, &h, sizeof(h));
+        memcpy(id + 8, &h, sizeof(h));
+    }
+
+    for (i = 0; i < (int)sizeof(id); i++) {
+        sprintf(seq->runid + i * 2, "%02x", id[i]);
+    }
+}
+
+/*
+ * Keep a copy of a line that syslog could not take yet. When the queue
+ * is full the line is lost, as waiting for syslog to make room would
+ * hold up every child and every timeout along with it.
+ */
+static void log_queue(sequence_t *seq, struct msghdr *m)
+{
+    logq_t *q = seq->logq;
+
+    size_t len = 0, i;
+
+    char *msg;
+
+    if (!q) {
+        q = seq->logq = calloc(1, sizeof(logq_t));
+    }
+
+    if (!q || q->count == SYSLOG_QUEUE) {
+        seq->logdropped++;
+        return;
+    }
+
+    for (i = 0; i < m->msg_iovlen; i++) {
+        len += m->msg_iov[i].iov_len;
+    }
+
+    msg = malloc(len ? len : 1);
+    if (!msg) {
+        seq->logdropped++;
+        return;
+    }
+
+    for (len = 0, i = 0; i < m->msg_iovlen; i++) {
+        memcpy(msg + len, m->msg_iov[i].iov_base, m->msg_iov[i].iov_len);
+        len += m->msg_iov[i].iov_len;
+    }
+
+    i = (q->head + q->count++) % SYSLOG_QUEUE;
+    q->msg[i] = msg;
+    q->len[i] = len;
+}
+
+/*
+ * Send the batch of lines to syslog, as many as we can in one go. If
+ * syslog has gone away, we connect again once, and if it cannot keep
+ * up, the rest wait in the queue. Lines keep their order throughout.
+ */
+static void log_send(sequence_t *seq, batch_t *b)
+{
+    int sent = 0, retried = 0;
+
+    log_reconnect(seq);
+    log_flush(seq, 0);
+
+    while (sent < b->nmsgs && seq->logfd != -1 &&
+            !(seq->logq && seq->logq->count)) {
+
+        int n = sendmmsg(seq->logfd, b->msgs + sent, b->nmsgs - sent,
+                MSG_DONTWAIT);
+
+        if (n > 0) {
+            seq->logsent = monotonic();
+            sent += n;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno == EAGAIN || errno == ENOBUFS) {
+            break;
+        }
+
+        if ((errno == ECONNREFUSED || errno == ENOTCONN) && !retried) {
+            retried = 1;
+            log_connect(seq);
+            continue;
+        }
+
+        /* anything else, such as a line too long for syslog, is lost */
+        if (errno != EMSGSIZE || log_memfd(seq, b->msgs[sent].msg_hdr.msg_iov,
+                b->msgs[sent].msg_hdr.msg_iovlen)) {
+            seq->logdropped++;
+        }
+        sent++;
+    }
+
+    while (sent < b->nmsgs) {
+        log_queue(seq, &b->msgs[sent++].msg_hdr);
+    }
+}
+
+/*
+ * Add a journal field naming the child to the header. A name is free to
+ * hold a newline, which would end the field early and let the rest pass
+ * for fields of its own, so such a name is given with its length instead,
+ * as a multi-line message is.
+ */
+static int log_field(batch_t *b, int len, const char *key, const char *value)
+{
+    size_t klen = strlen(key), vlen = strnlen(value, 256);
+
+    char *p = b->header + len;
+
+    int i;
+
+    if (len + klen + vlen + 10 >= sizeof(b->header)) {
+        return len;
+    }
+
+    memcpy(p, key, klen);
+    p += klen;
+
+    if (memchr(value, '\n', vlen)) {
+        *p++ = '\n';
+        for (i = 0; i < 8; i++) {
+            *p++ = (uint64_t)vlen >> (i * 8);
+        }
+    }
+    else {
+        *p++ = '=';
+    }
+
+    memcpy(p, value, vlen);
+    p += vlen;
+    *p++ = '\n';
+
+    return p - b->header;
+}
+
+/*
+ * Work out the header for the lines of a child, the priority, the time
+ * and the name and pid of the child. For the journal, these are the
+ * fields that go in front of the message of each record.
+ */
+static void log_header(sequence_t *seq, child_t *child, batch_t *b)
+{
+    struct timespec now;
+
+    struct tm tm;
+
+    char stamp[64], zone[8];
+
+    int len;
+
+    if (seq->journald) {
+
+        const char *script = strrchr(child->path, '/');
+
+        len = snprintf(b->header, sizeof(b->header),
+                "PRIORITY=%d\n"
+                "SYSLOG_FACILITY=%d\n"
+                "SEQUENCE_RUN_ID=%s\n",
+                seq->level, seq->facility >> 3, seq->runid);
+
+        len = log_field(b, len, "SYSLOG_IDENTIFIER", child->path);
+        len = log_field(b, len, "SEQUENCE_SCRIPT",
+                script ? script + 1 : child->path);
+
+        if (child->pid && len < (int)sizeof(b->header)) {
+            len += snprintf(b->header + len, sizeof(b->header) - len,
+                    "SYSLOG_PID=%d\n", child->pid);
+        }
+
+        if (b->stamplen && len < (int)sizeof(b->header)) {
+            len += snprintf(b->header + len, sizeof(b->header) - len,
+                    "SEQUENCE_TIMESTAMP=%.*s\n", (int)b->stamplen - 1, b->stamp);
+        }
+
+        if (len < (int)sizeof(b->header)) {
+            len += snprintf(b->header + len, sizeof(b->header) - len,
+                    "MESSAGE=");
+        }
+
+        b->headerlen = len < (int)sizeof(b->header) ? (size_t)len :
+                sizeof(b->header) - 1;
+
+        return;
+    }
+
+    /* the time the lines were read, if that was asked for */
+    if (seq->timestamps == TIMESTAMPS_REAL) {
+        now.tv_sec = b->now / NANOSECONDS;
+        now.tv_nsec = b->now % NANOSECONDS;
+    }
+    else {
+        clock_gettime(CLOCK_REALTIME, &now);
+    }
+    localtime_r(&now.tv_sec, &tm);
+
+    if (seq->logformat == SYSLOG_RFC5424) {
+
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        strftime(zone, sizeof(zone), "%z", &tm);
+
+        if (child->pid) {
+            len = snprintf(b->header, sizeof(b->header),
+                    "<%d>1 %s.%06ld%.3s:%.2s %s %.48s %d - - ",
+                    seq->facility | seq->level, stamp, now.tv_nsec / 1000,
+                    zone, zone + 3, seq->hostname, child->path, child->pid);
+        }
+        else {
+            len = snprintf(b->header, sizeof(b->header),
+                    "<%d>1 %s.%06ld%.3s:%.2s %s %.48s - - - ",
+                    seq->facility | seq->level, stamp, now.tv_nsec / 1000,
+                    zone, zone + 3, seq->hostname, child->path);
+        }
+    }
+    else {
+
+        strftime(stamp, sizeof(stamp), "%b %e %H:%M:%S", &tm);
+
+        if (child->pid) {
+            len = snprintf(b->header, sizeof(b->header), "<%d>%s %.128s[%d]: ",
+                    seq->facility | seq->level, stamp, child->path, child->pid);
+        }
+        else {
+            len = snprintf(b->header, sizeof(b->header), "<%d>%s %.128s: ",
+                    seq->facility | seq->level, stamp, child->path);
+        }
+    }
+
+    b->headerlen = len < (int)sizeof(b->header) ? (size_t)len :
+                sizeof(b->header) - 1;
+}
+
+/*
+ * The time as asked for with --timestamps, in nanoseconds: since boot,
+ * since the epoch, or since the child was started. Both clocks are read
+ * through the vDSO, and we read them once per batch rather than per line.
+ */
+static long long relay_clock(sequence_t *seq, child_t *child)
+{
+    struct timespec ts;
+
+    if (seq->timestamps == TIMESTAMPS_REAL) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return ts.tv_sec * NANOSECONDS + ts.tv_nsec;
+    }
+
+    if (seq->timestamps == TIMESTAMPS_DELTA) {
+        return child->pid ? monotonic() - child->started : 0;
+    }
+
+    return monotonic();
+}
+
+/*
+ * Start a batch, reading the clock if anyone is going to see the time.
+ */
+static void relay_begin(sequence_t *seq, child_t *child, batch_t *b)
+{
+    long long now;
+
+    b->count = 0;
+    b->len = 0;
+    b->nmsgs = 0;
+    b->headerlen = 0;
+    b->now = 0;
+    b->mono = 0;
+    b->stamplen = 0;
+
+    if (seq->timestamps == TIMESTAMPS_NONE) {
+        if (seq->output != OUTPUT_TEXT) {
+            b->now = monotonic();
+        }
+        return;
+    }
+
+    b->now = now = relay_clock(seq, child);
+
+    /* the records carry the time as a number */
+    if (seq->output != OUTPUT_TEXT) {
+        return;
+    }
+
+    if (seq->timestamps == TIMESTAMPS_REAL) {
+
+        struct tm tm;
+
+        time_t secs = now / NANOSECONDS;
+
+        char zone[8];
+
+        size_t len;
+
+        localtime_r(&secs, &tm);
+
+        len = strftime(b->stamp, sizeof(b->stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        strftime(zone, sizeof(zone), "%z", &tm);
+
+        b->stamplen = len + snprintf(b->stamp + len, sizeof(b->stamp) - len,
+                ".%06lld%.3s:%.2s ", now % NANOSECONDS / 1000, zone, zone + 3);
+    }
+    else {
+
+        b->stamplen = snprintf(b->stamp, sizeof(b->stamp), "%s%lld.%06lld ",
+                seq->timestamps == TIMESTAMPS_DELTA ? "+" : "",
+                now / NANOSECONDS, now % NANOSECONDS / 1000);
+    }
+}
+
+/*
+ * Write out the records gathered so far.
+ */
+static void output_flush(sequence_t *seq)
+{
+    const char *p = seq->out;
+
+    size_t left = seq->outlen;
+
+    while (left) {
+
+        ssize_t n = write(STDERR_FILENO, p, left);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    seq->outlen = 0;
+}
+
+static char *output_number(char *p, long long v)
+{
+    char buf[24], *b = buf + sizeof(buf);
+
+    unsigned long long u = v < 0 ? -(unsigned long long)v :
+            (unsigned long long)v;
+
+    do {
+        *--b = '0' + u % 10;
+        u /= 10;
+    } while (u);
+
+    if (v < 0) {
+        *--b = '-';
+    }
+
+    memcpy(p, b, buf + sizeof(buf) - b);
+
+    return p + (buf + sizeof(buf) - b);
+}
+
+static char *output_string(char *p, const char *s)
+{
+    size_t len = strlen(s);
+
+    memcpy(p, s, len);
+
+    return p + len;
+}
+
+static char *output_put(char *p, uint64_t v, int bytes)
+{
+    while (bytes--) {
+        *p++ = v >> (bytes * 8);
+    }
+
+    return p;
+}
+
+/*
+ * Escape a string for JSON. Bytes that are not part of valid UTF-8 are
+ * taken to be Latin-1, so that whatever a child writes, the record can
+ * still be parsed.
+ */
+static char *output_escape(char *p, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    const unsigned char *u = (const unsigned char *)s, *end = u + len;
+
+    while (u < end) {
+
+        const unsigned char *run = u;
+
+        unsigned char c;
+
+        size_t n = 0;
+
+        /* copy plain text in one go */
+        while (u < end && *u >= 0x20 && *u < 0x7f && *u != '"' && *u != '\\') {
+            u++;
+        }
+
+        memcpy(p, run, u - run);
+        p += u - run;
+
+        if (u == end) {
+            break;
+        }
+
+        c = *u;
+
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+            u++;
+            continue;
+        }
+
+        if (c == '\n' || c == '\t') {
+            *p++ = '\\';
+            *p++ = c == '\n' ? 'n' : 't';
+            u++;
+            continue;
+        }
+
+        /* how long a UTF-8 sequence starting here claims to be */
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 2;
+        }
+        else if (c >= 0xe0 && c <= 0xef) {
+            n = 3;
+        }
+        else if (c >= 0xf0 && c <= 0xf4) {
+            n = 4;
+        }
+
+        if (n && (size_t)(end - u) >= n) {
+
+            size_t i;
+
+            for (i = 1; i < n && (u[i] & 0xc0) == 0x80; i++);
+
+            /* no overlong forms, surrogates or anything past U+10FFFF */
+            if (i == n && !(c == 0xe0 && u[1] < 0xa0) &&
+                    !(c == 0xed && u[1] >= 0xa0) &&
+                    !(c == 0xf0 && u[1] < 0x90) &&
+                    !(c == 0xf4 && u[1] >= 0x90)) {
+                memcpy(p, u, n);
+                p += n;
+                u += n;
+                continue;
+            }
+        }
+
+        *p++ = '\\';
+        *p++ = 'u';
+        *p++ = '0';
+        *p++ = '0';
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 0xf];
+        u++;
+    }
+
+    return p;
+}
+
+static char *output_json(char *p, const char *s, size_t len)
+{
+    *p++ = '"';
+    p = output_escape(p, s, len);
+    *p++ = '"';
+
+    return p;
+}
+
+/*
+ * Make room for a record whose variable parts are up to len bytes long,
+ * and begin it with the fields every record has. Returns where the rest
+ * of the record goes, or NULL if we are out of memory.
+ */
+static char *output_begin(sequence_t *seq, const char *path, pid_t pid,
+        int type, long long now, size_t len)
+{
+    static const char *types[] = {
+        NULL, "line", "spawn", "exit", "error", "sequence"
+    };
+
+    size_t pathlen = strlen(path);
+
+    size_t need = seq->outlen + OUTPUT_FIELDS + (pathlen + len) * 6;
+
+    char *p;
+
+    if (need > seq->outsize) {
+
+        size_t size = seq->outsize ? seq->outsize : RELAY_SIZE;
+
+        char *out;
+
+        while (size < need) {
+            size *= 2;
+        }
+
+        out = realloc(seq->out, size);
+        if (!out) {
+            return NULL;
+        }
+
+        seq->out = out;
+        seq->outsize = size;
+    }
+
+    p = seq->out + seq->outlen;
+
+    if (seq->output == OUTPUT_FRAMES) {
+
+        /* the length is filled in once the record is done */
+        p = output_put(p, 0, 4);
+        p = output_put(p, type, 1);
+        p = output_put(p, type == EVENT_LINE ? STDERR_FILENO : 0, 1);
+        p = output_put(p, pathlen, 2);
+        p = output_put(p, pid, 4);
+        p = output_put(p, now, 8);
+        memcpy(p, path, pathlen);
+
+        return p + pathlen;
+    }
+
+    p = output_string(p, "{\"type\":\"");
+    p = output_string(p, types[type]);
+    p = output_string(p, "\",\"time\":");
+    p = output_number(p, now);
+    p = output_string(p, ",\"script\":");
+    p = output_json(p, path, pathlen);
+    p = output_string(p, ",\"pid\":");
+    p = output_number(p, pid);
+
+    return p;
+}
+
+/*
+ * Finish the record that ends at p. Records are gathered up until they
+ * would no longer fit in a single atomic write, in the same way as lines
+ * of text.
+ */
+static void output_end(sequence_t *seq, char *p)
+{
+    size_t start = seq->outlen;
+
+    if (seq->output == OUTPUT_FRAMES) {
+        output_put(seq->out + start, p - seq->out - start - 4, 4);
+    }
+    else {
+        *p++ = '}';
+        *p++ = '\n';
+    }
+
+    seq->outlen = p - seq->out;
+
+    if (start && seq->outlen > PIPE_BUF) {
+
+        size_t len = seq->outlen - start;
+
+        seq->outlen = start;
+        output_flush(seq);
+
+        memmove(seq->out, seq->out + start, len);
+        seq->outlen = len;
+    }
+
+    /* too long to share a write with anything else */
+    if (seq->outlen > PIPE_BUF) {
+        output_flush(seq);
+    }
+}
+
+/*
+ * A line from a child, as a record.
+ */
+static void output_line(sequence_t *seq, child_t *child, long long now,
+        const char *held, size_t heldlen, const char *line, size_t len)
+{
+    char *p = output_begin(seq, child->path, child->pid, EVENT_LINE, now,
+            heldlen + len);
+
+    if (!p) {
+        return;
+    }
+
+    if (seq->output == OUTPUT_FRAMES) {
+        memcpy(p, held, heldlen);
+        p += heldlen;
+        memcpy(p, line, len);
+        p += len;
+    }
+    else {
+        p = output_string(p, ",\"stream\":\"stderr\",\"data\":\"");
+        p = output_escape(p, held, heldlen);
+        p = output_escape(p, line, len);
+        *p++ = '"';
+    }
+
+    output_end(seq, p);
+}
+
+/*
+ * Something has happened to a child: it has been spawned, it has exited
+ * with the given code, or it could not be run for the given reason.
+ */
+static void output_event(sequence_t *seq, child_t *child, int type,
+        int code, const char *message)
+{
+    size_t len = message ? strlen(message) : 0;
+
+    long long wall = 0, user, sys;
+
+    int sig = 0;
+
+    char *p = output_begin(seq, child->path, child->pid, type,
+            relay_clock(seq, child), len);
+
+    if (!p) {
+        return;
+    }
+
+    if (type == EVENT_EXIT) {
+
+        /* children replayed from the cache never ran */
+        if (child->pid && child->reaped) {
+            wall = child->exited - child->started;
+            if (!child->error && WIFSIGNALED(child->status)) {
+                sig = WTERMSIG(child->status);
+            }
+        }
+
+        user = child->usage.ru_utime.tv_sec * NANOSECONDS +
+                child->usage.ru_utime.tv_usec * 1000LL;
+        sys = child->usage.ru_stime.tv_sec * NANOSECONDS +
+                child->usage.ru_stime.tv_usec * 1000LL;
+
+        if (seq->output == OUTPUT_FRAMES) {
+            p = output_put(p, code, 4);
+            p = output_put(p, sig, 4);
+            p = output_put(p, wall, 8);
+            p = output_put(p, user, 8);
+            p = output_put(p, sys, 8);
+            p = output_put(p, child->usage.ru_maxrss, 8);
+            p = output_put(p, child->usage.ru_majflt, 8);
+            p = output_put(p, child->usage.ru_minflt, 8);
+            p = output_put(p, child->usage.ru_nvcsw, 8);
+            p = output_put(p, child->usage.ru_nivcsw, 8);
+            p = output_put(p, child->dropped, 8);
+        }
+        else {
+            p += sprintf(p, ",\"code\":%d,\"signal\":%d,\"wall\":%lld,"
+                    "\"user\":%lld,\"system\":%lld,\"maxrss\":%ld,"
+                    "\"majflt\":%ld,\"minflt\":%ld,\"nvcsw\":%ld,"
+                    "\"nivcsw\":%ld,\"dropped\":%ld", code, sig, wall, user,
+                    sys, child->usage.ru_maxrss, child->usage.ru_majflt,
+                    child->usage.ru_minflt, child->usage.ru_nvcsw,
+                    child->usage.ru_nivcsw, child->dropped);
+        }
+    }
+
+    else if (type == EVENT_ERROR) {
+
+        if (seq->output == OUTPUT_FRAMES) {
+            memcpy(p, message, len);
+            p += len;
+        }
+        else {
+            p = output_string(p, ",\"message\":");
+            p = output_json(p, message, len);
+        }
+    }
+
+    output_end(seq, p);
+    output_flush(seq);
+}
+
+/*
+ * Tell the user something about the run as a whole. With ndjson or frames
+ * the message becomes a 'sequence' record, with no name and our own
+ * process id, so that it cannot break up the stream.
+ */
+static void notice(sequence_t *seq, const char *fmt, ...)
+{
+    char message[1024];
+
+    va_list ap;
+
+    struct timespec ts;
+
+    long long now;
+
+    char *p;
+
+    int len;
+
+    if (seq->output == OUTPUT_TEXT) {
+        fprintf(stderr, "%s: ", seq->name);
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+
+    va_start(ap, fmt);
+    len = vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        return;
+    }
+    if (len >= (int)sizeof(message)) {
+        len = sizeof(message) - 1;
+    }
+
+    /* the run as a whole has no start of its own to count from */
+    if (seq->timestamps == TIMESTAMPS_REAL) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now = ts.tv_sec * NANOSECONDS + ts.tv_nsec;
+    }
+    else if (seq->timestamps == TIMESTAMPS_DELTA) {
+        now = 0;
+    }
+    else {
+        now = monotonic();
+    }
+
+    p = output_begin(seq, "", getpid(), EVENT_SEQUENCE, now, len);
+    if (!p) {
+        return;
+    }
+
+    if (seq->output == OUTPUT_FRAMES) {
+        memcpy(p, message, len);
+        p += len;
+    }
+    else {
+        p = output_string(p, ",\"message\":");
+        p = output_json(p, message, len);
+    }
+
+    output_end(seq, p);
+    output_flush(seq);
+}
+
+/*
+ * Write the batch. A batch is never more than PIPE_BUF long unless it
+ * holds a single line, so no line that fits is ever torn apart by the
+ * writes of another process sharing our stderr.
+ */
+static void relay_write(sequence_t *seq, batch_t *b)
+{
+    struct iovec *iov = b->iov;
+
+    int count = b->count;
+
+    if (seq->outlen) {
+        output_flush(seq);
+    }
+
+    if (b->nmsgs) {
+        log_send(seq, b);
+        count = 0;
+    }
+
+    while (count) {
+
+        ssize_t n = writev(STDERR_FILENO, iov, count);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        while (count && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    b->count = 0;
+    b->len = 0;
+    b->nmsgs = 0;
+}
+
+static void relay_add(batch_t *b, const void *buf, size_t len)
+{
+    if (len) {
+        b->iov[b->count].iov_base = (void *)buf;
+        b->iov[b->count].iov_len = len;
+        b->count++;
+        b->len += len;
+    }
+}
+
+/*
+ * Pass on a line, made up of what was held over from earlier reads and
+ * what has just arrived.
+ */
+static void relay_emit(sequence_t *seq, child_t *child, batch_t *b,
+        const char *held, size_t heldlen, const char *line, size_t len)
+{
+    size_t pathlen, total;
+
+    const char *nl;
+
+    if (seq->output != OUTPUT_TEXT) {
+        output_line(seq, child, b->now, held, heldlen, line, len);
+        return;
+    }
+
+    if (seq->slog) {
+
+        struct msghdr *m;
+
+        if (b->count + 6 > RELAY_IOV) {
+            relay_write(seq, b);
+        }
+
+        if (!b->headerlen) {
+            log_header(seq, child, b);
+        }
+
+        m = &b->msgs[b->nmsgs++].msg_hdr;
+        memset(m, 0, sizeof(*m));
+        m->msg_iov = &b->iov[b->count];
+
+        /* a journal field holding newlines must give its length instead */
+        if (seq->journald && seq->multiline && memchr(line, '\n', len)) {
+
+            unsigned char *l = b->lens[b->nmsgs - 1];
+
+            uint64_t v = heldlen + len;
+
+            int i;
+
+            for (i = 0; i < 8; i++) {
+                l[i] = v >> (i * 8);
+            }
+
+            relay_add(b, b->header, b->headerlen - strlen("MESSAGE="));
+            relay_add(b, "MESSAGE\n", 8);
+            relay_add(b, l, 8);
+        }
+        else {
+            relay_add(b, b->header, b->headerlen);
+        }
+
+        /* an RFC5424 header has room for the real time, nothing else does */
+        if (!seq->journald && !(seq->timestamps == TIMESTAMPS_REAL &&
+                seq->logformat == SYSLOG_RFC5424)) {
+            relay_add(b, b->stamp, b->stamplen);
+        }
+        relay_add(b, held, heldlen);
+        relay_add(b, line, len);
+        if (seq->journald) {
+            relay_add(b, "\n", 1);
+        }
+
+        m->msg_iovlen = &b->iov[b->count] - m->msg_iov;
+
+        return;
+    }
+
+    /* each line of a folded record keeps its own prefix */
+    while (seq->multiline && (nl = memchr(line, '\n', len))) {
+        relay_emit(seq, child, b, held, heldlen, line, nl - line);
+        held = NULL;
+        heldlen = 0;
+        len -= nl + 1 - line;
+        line = nl + 1;
+    }
+
+    pathlen = strlen(child->path);
+    total = b->stamplen + pathlen + 2 + heldlen + len + 1;
+
+    if (b->count && (b->count + 6 > RELAY_IOV || b->len + total > PIPE_BUF)) {
+        relay_write(seq, b);
+    }
+
+    relay_add(b, b->stamp, b->stamplen);
+    relay_add(b, child->path, pathlen);
+    relay_add(b, ": ", 2);
+    relay_add(b, held, heldlen);
+    relay_add(b, line, len);
+    relay_add(b, "\n", 1);
+
+    /* too long to share a write with anything else */
+    if (b->len > PIPE_BUF) {
+        relay_write(seq, b);
+    }
+}
+
+/*
+ * Pass on a line of our own about what the child has been saying. It is
+ * written at once, as the batch cannot hold on to it.
+ */
+static void relay_note(sequence_t *seq, child_t *child, batch_t *b,
+        const char *fmt, ...)
+{
+    va_list ap;
+
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(b->note, sizeof(b->note), fmt, ap);
+    va_end(ap);
+
+    if (len >= (int)sizeof(b->note)) {
+        len = sizeof(b->note) - 1;
+    }
+
+    relay_emit(seq, child, b, "", 0, b->note, len);
+    relay_write(seq, b);
+}
+
+/*
+ * Top up a bucket for the time gone by, up to a second's worth.
+ */
+static void bucket_refill(bucket_t *bk, long lines, long bytes, long long now)
+{
+    double secs = (now - bk->refilled) / (double)NANOSECONDS;
+
+    if (!bk->refilled) {
+        bk->lines = lines;
+        bk->bytes = bytes;
+    }
+    else {
+        bk->lines += lines * secs;
+        bk->bytes += bytes * secs;
+        if (bk->lines > lines) {
+            bk->lines = lines;
+        }
+        if (bk->bytes > bytes) {
+            bk->bytes = bytes;
+        }
+    }
+
+    bk->refilled = now;
+}
+
+/*
+ * Is there room for the line? A line longer than the bytes allowed in a
+ * second gets through when the bucket is full, so that it is not held
+ * back forever.
+ */
+static int bucket_allows(const bucket_t *bk, long lines, long bytes,
+        size_t len)
+{
+    return (!lines || bk->lines >= 1) &&
+            (!bytes || bk->bytes >= len || bk->bytes >= bytes);
+}
+
+/*
+ * Pass on a line, unless it is the same as the line before, or unless
+ * the child or the run as a whole is over the rate limit. Either way we
+ * keep reading, so the child never waits on us while we drop lines.
+ */
+static void relay_record(sequence_t *seq, child_t *child, batch_t *b,
+        const char *held, size_t heldlen, const char *line, size_t len)
+{
+    size_t total = heldlen + len;
+
+    if (seq->collapse) {
+
+        if (child->last && child->lastlen == total &&
+                !memcmp(child->last, held, heldlen) &&
+                !memcmp(child->last + heldlen, line, len)) {
+            child->repeats++;
+            return;
+        }
+
+        if (child->repeats) {
+            relay_note(seq, child, b, "last message repeated %ld times",
+                    child->repeats);
+            child->repeats = 0;
+        }
+
+        if (total > child->lastsize) {
+
+            char *last = realloc(child->last, total);
+
+            if (last) {
+                child->last = last;
+                child->lastsize = total;
+            }
+        }
+
+        if (total <= child->lastsize) {
+            memcpy(child->last, held, heldlen);
+            memcpy(child->last + heldlen, line, len);
+            child->lastlen = total;
+        }
+        else {
+            child->lastlen = 0;
+        }
+    }
+
+    if (seq->ratelines || seq->ratebytes || seq->totallines ||
+            seq->totalbytes) {
+
+        bucket_t *bk = seq->bucket;
+
+        if (!b->mono) {
+            b->mono = monotonic();
+        }
+
+        bucket_refill(&child->bucket, seq->ratelines, seq->ratebytes, b->mono);
+        bucket_refill(bk, seq->totallines, seq->totalbytes, b->mono);
+
+        if (!bucket_allows(&child->bucket, seq->ratelines, seq->ratebytes,
+                total) ||
+                !bucket_allows(bk, seq->totallines, seq->totalbytes, total)) {
+            child->dropped++;
+            child->droppedbytes += total;
+            return;
+        }
+
+        child->bucket.lines--;
+        child->bucket.bytes -= total;
+        bk->lines--;
+        bk->bytes -= total;
+    }
+
+    relay_emit(seq, child, b, held, heldlen, line, len);
+}
+
+/*
+ * Pass on the record the child has been building up.
+ */
+static void relay_fold(sequence_t *seq, child_t *child, batch_t *b)
+{
+    /* a blank line is a record too, so go by whether one is open */
+    if (child->recordopen) {
+        relay_record(seq, child, b, NULL, 0, child->record + child->recordstart,
+                child->recordlen);
+        child->recordstart += child->recordlen;
+        child->recordlen = 0;
+        child->recordopen = 0;
+    }
+}
+
+/*
+ * Move the record being built to the front, once the records before it
+ * have been written.
+ */
+static void relay_compact(child_t *child)
+{
+    if (child->recordstart) {
+        memmove(child->record, child->record + child->recordstart,
+                child->recordlen);
+        child->recordstart = 0;
+    }
+}
+
+/*
+ * Does the line start a record of its own? Without start patterns, lines
+ * that are indented carry on the record before them.
+ */
+static int relay_starts(sequence_t *seq, const char *line, size_t len)
+{
+    size_t i;
+
+    if (!seq->nstarts) {
+        return !len || (line[0] != ' ' && line[0] != '\t');
+    }
+
+    for (i = 0; i < seq->nstarts; i++) {
+        if (!regexec(&seq->starts[i], line, 0, NULL, 0)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Pass on a line. With --multiline, lines are folded into records first,
+ * and a record is only passed on once a line arrives that starts a new
+ * one, once it grows too long, or once the child has been quiet for a
+ * while. Finished records stay where they are until the batch has been
+ * written, so that the batch can point at them.
+ */
+static void relay_line(sequence_t *seq, child_t *child, batch_t *b,
+        const char *held, size_t heldlen, const char *line, size_t len)
+{
+    size_t total = heldlen + len, need;
+
+    char *p;
+
+    if (!seq->multiline) {
+        relay_record(seq, child, b, held, heldlen, line, len);
+        return;
+    }
+
+    /* room for a newline before the line and a terminator after it */
+    need = child->recordstart + child->recordlen + total + 2;
+
+    if (need > child->recordsize && child->recordstart) {
+        relay_write(seq, b);
+        relay_compact(child);
+        need = child->recordlen + total + 2;
+    }
+
+    if (need > child->recordsize) {
+
+        size_t size = child->recordsize ? child->recordsize : 1024;
+
+        char *record;
+
+        while (size < need) {
+            size *= 2;
+        }
+
+        record = realloc(child->record, size);
+        if (!record) {
+            /* pass on what we have, and the line as it is */
+            relay_fold(seq, child, b);
+            relay_record(seq, child, b, held, heldlen, line, len);
+            relay_write(seq, b);
+            relay_compact(child);
+            return;
+        }
+
+        child->record = record;
+        child->recordsize = size;
+    }
+
+    p = child->record + child->recordstart + child->recordlen;
+    if (child->recordopen) {
+        *p++ = '\n';
+    }
+
+    memcpy(p, held, heldlen);
+    memcpy(p + heldlen, line, len);
+    p[total] = 0;
+
+    if (!b->mono) {
+        b->mono = monotonic();
+    }
+    child->recorded = b->mono;
+
+    if (!child->recordopen) {
+        child->recordlen = total;
+        child->recordopen = 1;
+    }
+    else if (relay_starts(seq, p, total) ||
+            child->recordlen + 1 + total > seq->recordsize) {
+        relay_fold(seq, child, b);
+        child->recordstart = p - child->record;
+        child->recordlen = total;
+        child->recordopen = 1;
+    }
+    else {
+        child->recordlen += 1 + total;
+    }
+}
+
+/*
+ * Pass on a record the child has left waiting for too long.
+ */
+static void relay_idle(sequence_t *seq, child_t *child)
+{
+    batch_t b;
+
+    relay_begin(seq, child, &b);
+    relay_fold(seq, child, &b);
+    relay_write(seq, &b);
+    relay_compact(child);
+}
+
+/*
+ * Pass on each complete line in the buffer, prefixed with the name of
+ * the child, or to syslog. Lines that straddle reads are held until
+ * their end arrives.
+ */
+static void relay(sequence_t *seq, child_t *child, const char *errbuf, int n)
+{
+    const char *p = errbuf, *end = errbuf + n, *nl;
+
+    batch_t b;
+
+    relay_begin(seq, child, &b);
+
+    while ((nl = memchr(p, '\n', end - p))) {
+
+        relay_line(seq, child, &b, child->partial, child->partiallen, p,
+                nl - p);
+
+        child->partiallen = 0;
+
+        p = nl + 1;
+    }
+
+    /* the batch may point at what we held, let it go before we reuse it */
+    relay_write(seq, &b);
+    relay_compact(child);
+
+    if (p == end) {
+        return;
+    }
+
+    if (child->partiallen + (end - p) > child->partialsize) {
+
+        size_t size = child->partialsize ? child->partialsize : 1024;
+
+        char *partial;
+
+        while (size < child->partiallen + (end - p)) {
+            size *= 2;
+        }
+
+        partial = realloc(child->partial, size);
+        if (!partial) {
+            /* pass on what we have as a line of its own */
+            relay_line(seq, child, &b, child->partial, child->partiallen,
+                    p, end - p);
+            relay_write(seq, &b);
+            child->partiallen = 0;
+            return;
+        }
+
+        child->partial = partial;
+        child->partialsize = size;
+    }
+
+    memcpy(child->partial + child->partiallen, p, end - p);
+    child->partiallen += end - p;
+
+    /* a line with no end in sight is passed on as it is */
+    if (child->partiallen >= RELAY_LINE) {
+        relay_line(seq, child, &b, child->partial, child->partiallen, NULL, 0);
+        relay_write(seq, &b);
+        child->partiallen = 0;
+    }
+
+}
+
+/*
+ * The child will say no more, pass on any last line that did not end
+ * with a newline.
+ */
+static void relay_end(sequence_t *seq, child_t *child)
+{
+    batch_t b;
+
+    relay_begin(seq, child, &b);
+
+    if (child->partiallen) {
+        relay_line(seq, child, &b, child->partial, child->partiallen, NULL, 0);
+    }
+
+    relay_fold(seq, child, &b);
+    relay_write(seq, &b);
+    relay_compact(child);
+
+    if (child->repeats) {
+        relay_note(seq, child, &b, "last message repeated %ld times",
+                child->repeats);
+        child->repeats = 0;
+    }
+
+    /* the exit record counts them instead */
+    if (child->dropped && seq->output == OUTPUT_TEXT) {
+        relay_note(seq, child, &b, "%ld lines (%lld bytes) dropped over the rate limit",
+                child->dropped, child->droppedbytes);
+    }
+
+    free(child->partial);
+    child->partial = NULL;
+    child->partiallen = 0;
+    child->partialsize = 0;
+}
+
+/*
+ * Collect the exit status of a child, if it has exited. Returns zero
+ * while the child is still running.
+ */
+static int reap(child_t *child)
+{
+    pid_t w;
+
+    w = wait4(child->pid, &child->status, WNOHANG, &child->usage);
+
+    /* still running */
+    if (w == 0) {
+        return 0;
+    }
+
+    child->reaped = 1;
+    child->exited = monotonic();
+    child->error = (w == -1) ? errno : 0;
+
+    return 1;
+}
+
+/*
+ * Parse a number of seconds, with an optional fraction.
+ */
+static int parse_seconds(const char *arg, long long *ns)
+{
+    char *end;
+    double secs;
+
+    errno = 0;
+    secs = strtod(arg, &end);
+    if (errno || end == arg || *end || secs <= 0 || secs > LLONG_MAX / NANOSECONDS) {
+        return -1;
+    }
+
+    *ns = secs * NANOSECONDS;
+
+    return 0;
+}
+
+/*
+ * Parse a rate limit of lines and bytes per second, either of which may
+ * be zero for no limit.
+ */
+static int parse_rate(const char *arg, long *lines, long *bytes)
+{
+    char *end;
+
+    errno = 0;
+    *lines = strtol(arg, &end, 10);
+    *bytes = 0;
+
+    if (!errno && end != arg && *end == ',') {
+        arg = end + 1;
+        *bytes = strtol(arg, &end, 10);
+    }
+
+    if (errno || end == arg || *end || *lines < 0 || *bytes < 0 ||
+            (!*lines && !*bytes)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Turn the exit status of a child into our return code.
+ */
+static int decode(sequence_t *seq, child_t *child)
+{
+    int status = child->status;
+
+    /* the exit record tells the story instead */
+    int quiet = seq->output != OUTPUT_TEXT;
+
+    /* we stopped it, however it went */
+    if (child->timedout) {
+
+        if (!quiet) {
+            fprintf(stderr, "%s: %s timed out\n", seq->name,
+                    child->path);
+        }
+
+        return EXIT_TIMEOUT;
+    }
+
+    /* waitpid failed, we give up */
+    else if (child->error) {
+
+        if (!quiet) {
+            fprintf(stderr, "%s: waitpid for '%s' failed: %s\n", seq->name,
+                    child->path, strerror(child->error));
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    /* process successful exit */
+    else if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+
+        return EXIT_SUCCESS;
+    }
+
+    /* process non success exit */
+    else if (WIFEXITED(status)) {
+
+        if (!quiet) {
+            fprintf(stderr, "%s: %s returned %d\n", seq->name,
+                    child->path, status);
+        }
+
+        return WEXITSTATUS(status);
+    }
+
+    /* process received a signal */
+    else if (WIFSIGNALED(status)) {
+
+        if (!quiet) {
+            fprintf(stderr, "%s: %s signaled %d\n", seq->name,
+                    child->path, status);
+        }
+
+        return WTERMSIG(status) + 128;
+    }
+
+    /* otherwise weirdness, just leave */
+    else {
+
+        if (!quiet) {
+            fprintf(stderr, "%s: %s failed with %d\n", seq->name,
+                    child->path, status);
+        }
+
+        return EX_OSERR;
+    }
+
+}
+
+/*
+ * Get a pidfd for a child we did not get one for at spawn time.
+ */
+static int pidfd_get(pid_t pid)
+{
+#if defined(HAVE_PIDFD_OPEN)
+    return pidfd_open(pid, 0);
+#elif defined(SYS_pidfd_open)
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int spawn_exec(void *arg)
+{
+    spawn_t *sp = arg;
+
+    if ((sp->fd == -1 || dup2(sp->fd, STDERR_FILENO) != -1) &&
+            (sp->outfd == -1 || dup2(sp->outfd, STDOUT_FILENO) != -1) &&
+            (!sp->pgroup || setpgid(0, 0) != -1)) {
+
+        /* a group of our own is in the background unless given the tty */
+        if (sp->foreground) {
+            tcsetpgrp(STDIN_FILENO, getpid());
+        }
+
+        sigprocmask(SIG_SETMASK, &sp->mask, NULL);
+
+        /* the limit we raised to open the executables is not theirs */
+        if (sp->nofile) {
+            setrlimit(RLIMIT_NOFILE, sp->nofile);
+        }
+
+        if (sp->exec != -1) {
+
+            struct stat st1, st2;
+
+#if defined(HAVE_EXECVEAT)
+            execveat(sp->exec, "", sp->args, environ, AT_EMPTY_PATH);
+#elif defined(SYS_execveat)
+            syscall(SYS_execveat, sp->exec, "", sp->args, environ,
+                    AT_EMPTY_PATH);
+#endif
+
+            /*
+             * A script run through a descriptor would be handed to its
+             * interpreter as /dev/fd/N, losing its name in ${0}, and as
+             * our descriptor closes on exec, the kernel refuses. Scripts
+             * are run by name, as long as the name is still theirs, as
+             * is everything on kernels without execveat().
+             */
+            if (errno == ENOENT || errno == ENOSYS) {
+                if (fstat(sp->exec, &st1) || stat(sp->file, &st2) ||
+                        st1.st_dev != st2.st_dev || st1.st_ino != st2.st_ino) {
+                    errno = ESTALE;
+                }
+                else {
+                    execv(sp->file, sp->args);
+                }
+            }
+
+        }
+        else {
+            execv(sp->file, sp->args);
+        }
+    }
+
+    sp->error = errno;
+
+    /* a forked child must tell the parent the hard way */
+    if (sp->status != -1) {
+        while (write(sp->status, &sp->error, sizeof(sp->error)) == -1
+                && errno == EINTR);
+    }
+
+    _exit(127);
+}
+
+/*
+ * Start the child with fork(), learning the outcome of execv() through a
+ * pipe that closes on a successful exec.
+ */
+static pid_t spawn_fork(spawn_t *sp)
+{
+    int statuspair[2];
+
+    pid_t f;
+
+    if (pipe2(statuspair, O_CLOEXEC)) {
+        return -1;
+    }
+
+    f = fork();
+
+    /* child */
+    if (f == 0) {
+
+        close(statuspair[READ_FD]);
+
+        sp->status = statuspair[WRITE_FD];
+
+        spawn_exec(sp);
+    }
+
+    /* child is not calling spawn_exec() in our address space */
+    else if (f > 0) {
+
+        close(statuspair[WRITE_FD]);
+
+        while (read(statuspair[READ_FD], &sp->error, sizeof(sp->error)) == -1
+                && errno == EINTR);
+
+        close(statuspair[READ_FD]);
+
+        return f;
+    }
+
+    close(statuspair[READ_FD]);
+    close(statuspair[WRITE_FD]);
+
+    return f;
+}
+
+/*
+ * Start the child with a vfork style clone, sharing our memory until the
+ * child execs, saving the cost of copying our page tables. We are
+ * suspended until then, and the child leaves any exec error behind in
+ * sp->error.
+ */
+#ifdef HAVE_CLONE
+static pid_t spawn_clone(spawn_t *sp, int *pidfd)
+{
+    static char *stack;
+
+    pid_t f;
+
+    if (!stack) {
+        stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) {
+            stack = NULL;
+            return -1;
+        }
+    }
+
+    f = clone(spawn_exec, stack + SPAWN_STACK_SIZE,
+            CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, sp, pidfd);
+
+    /* kernels before 5.2 have no pidfd */
+    if (f == -1 && errno == EINVAL) {
+        *pidfd = -1;
+        f = clone(spawn_exec, stack + SPAWN_STACK_SIZE,
+                CLONE_VM | CLONE_VFORK | SIGCHLD, sp);
+    }
+
+    return f;
+}
+#endif
+
+/*
+ * How big may a pipe get? Read once from the system.
+ */
+static int pipe_max(sequence_t *seq)
+{
+    if (!seq->pipemax) {
+
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+
+        if (!f || fscanf(f, "%d", &seq->pipemax) != 1 || seq->pipemax <= 0) {
+            seq->pipemax = PIPE_MAX_SIZE;
+        }
+
+        if (f) {
+            fclose(f);
+        }
+    }
+
+    return seq->pipemax;
+}
+
+/*
+ * Size a new pipe as asked, and tell us how big it really is.
+ */
+static int pipe_size(sequence_t *seq, int fd)
+{
+#ifdef F_SETPIPE_SZ
+    int size;
+
+    if (seq->pipesize) {
+        fcntl(fd, F_SETPIPE_SZ, seq->pipesize);
+    }
+
+    size = fcntl(fd, F_GETPIPE_SZ);
+    if (size > 0) {
+        return size;
+    }
+#endif
+
+    return RELAY_SIZE;
+}
+
+/*
+ * The child has filled its pipe and has been left waiting on us. Unless
+ * the size was fixed by hand, double the pipe, so that the child can get
+ * further ahead next time, and we read more at a time.
+ */
+static void pipe_grow(sequence_t *seq, child_t *child)
+{
+#ifdef F_SETPIPE_SZ
+    int size;
+
+    if (seq->pipesize || child->pipesize >= pipe_max(seq)) {
+        return;
+    }
+
+    size = child->pipesize * 2 < pipe_max(seq) ?
+            child->pipesize * 2 : pipe_max(seq);
+
+    size = fcntl(child->fd, F_SETPIPE_SZ, size);
+    if (size > 0) {
+        child->pipesize = size;
+    }
+    else {
+        /* out of pipe space for this user, stop trying */
+        seq->pipemax = child->pipesize;
+    }
+#endif
+}
+
+static int spawn(sequence_t *seq, child_t *child, const char *file,
+        int exec, char **args)
+{
+    struct timespec start, end;
+
+    sigset_t all, mask;
+
+    spawn_t sp = { 0 };
+
+    int errpair[2] = { -1, -1 }, outpair[2] = { -1, -1 };
+
+    pid_t f;
+
+    child->pid = 0;
+    child->pidfd = -1;
+    child->outfd = -1;
+
+    /* the read side must not leak into the other children */
+    if (!seq->raw && pipe2(errpair, O_CLOEXEC)) {
+        notice(seq, "Could not create pipe: %s", strerror(errno));
+
+        return EXIT_FAILURE;
+    }
+
+    /* we must see whether a child we might cache writes to stdout */
+    if (child->cacheable && pipe2(outpair, O_CLOEXEC)) {
+        child->cacheable = 0;
+    }
+
+    args[0] = child->path;
+
+    sp.file = file;
+    sp.exec = exec;
+    sp.args = args;
+    sp.fd = errpair[WRITE_FD];
+    sp.outfd = outpair[WRITE_FD];
+    sp.status = -1;
+    sp.mask = seq->mask;
+    sp.nofile = seq->nofileraised ? &seq->nofile : NULL;
+    sp.pgroup = seq->timeout || seq->total;
+    sp.foreground = seq->foreground;
+
+    /* no signal handlers may run in the child before it execs */
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &mask);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef HAVE_CLONE
+    if (seq->backend == SPAWN_CLONE) {
+        f = spawn_clone(&sp, &child->pidfd);
+    }
+    else
+#endif
+    {
+        f = spawn_fork(&sp);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (errpair[WRITE_FD] != -1) {
+        close(errpair[WRITE_FD]);
+    }
+    if (outpair[WRITE_FD] != -1) {
+        close(outpair[WRITE_FD]);
+    }
+
+    child->pipesize = errpair[READ_FD] != -1 ?
+            pipe_size(seq, errpair[READ_FD]) : 0;
+    child->blocked = 0;
+
+    child->latency = (end.tv_sec - start.tv_sec) * 1000000000LL +
+            (end.tv_nsec - start.tv_nsec);
+
+    /* error */
+    if (f < 0) {
+        notice(seq, "Could not fork: %s", strerror(errno));
+
+        if (errpair[READ_FD] != -1) {
+            close(errpair[READ_FD]);
+        }
+        if (outpair[READ_FD] != -1) {
+            close(outpair[READ_FD]);
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    child->pid = f;
+    child->fd = errpair[READ_FD];
+    child->outfd = outpair[READ_FD];
+    child->reaped = 0;
+    child->timedout = 0;
+    child->started = end.tv_sec * NANOSECONDS + end.tv_nsec;
+    child->deadline = seq->timeout ? child->started + seq->timeout : 0;
+    memset(&child->usage, 0, sizeof(child->usage));
+
+    /* close the race with the child's own setpgid() and tcsetpgrp() */
+    if (sp.pgroup) {
+        setpgid(f, f);
+        if (sp.foreground) {
+            tcsetpgrp(STDIN_FILENO, f);
+        }
+    }
+
+    /* the child never made it to exec, we clean up after it */
+    if (sp.error) {
+
+        while (waitpid(f, NULL, 0) == -1 && errno == EINTR);
+
+        if (child->fd != -1) {
+            close(child->fd);
+        }
+        if (child->outfd != -1) {
+            close(child->outfd);
+        }
+        if (child->pidfd != -1) {
+            close(child->pidfd);
+        }
+
+        child->pid = 0;
+        child->pidfd = -1;
+        child->outfd = -1;
+
+        if (seq->ignore && sp.error == EACCES) {
+            return EXIT_SUCCESS;
+        }
+
+        if (seq->output != OUTPUT_TEXT) {
+            output_event(seq, child, EVENT_ERROR, 0, sp.error == ESTALE ?
+                    "Replaced since it was listed" : strerror(sp.error));
+        }
+        else {
+            notice(seq, "Could not execute '%s': %s",
+                    child->path, sp.error == ESTALE ?
+                            "Replaced since it was listed" : strerror(sp.error));
+        }
+
+        return EXIT_FAILURE;
+    }
+
+    if (child->pidfd == -1) {
+        child->pidfd = pidfd_get(f);
+    }
+
+    if (seq->output != OUTPUT_TEXT) {
+        output_event(seq, child, EVENT_SPAWN, 0, NULL);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Do two names share a stage?
+ *
+ * A stage is made up of the names that start with the same number, like
+ * 10-net and 10-dns. Names that do not start with a number stand alone.
+ */
+static int same_stage(const char *n1, const char *n2)
+{
+    size_t l1 = strspn(n1, "0123456789");
+    size_t l2 = strspn(n2, "0123456789");
+
+    return l1 && l1 == l2 && !memcmp(n1, n2, l1);
+}
+
+/*
+ * Append the rest of a header line to a space separated list.
+ */
+static char *header_add(char *list, const char *line, size_t len)
+{
+    size_t l = list ? strlen(list) : 0;
+
+    char *s = realloc(list, l + len + 2);
+    if (!s) {
+        return list;
+    }
+
+    if (l) {
+        s[l++] = ' ';
+    }
+    memcpy(s + l, line, len);
+    s[l + len] = 0;
+
+    return s;
+}
+
+/*
+ * Does the header line start with the given field? If so, return
+ * the value of the field.
+ */
+static const char *header_field(const char *line, const char *end,
+        const char *field)
+{
+    size_t len = strlen(field);
+
+    if ((size_t)(end - line) < len || strncasecmp(line, field, len)) {
+        return NULL;
+    }
+
+    return line + len;
+}
+
+/*
+ * Read the dependency headers from the top of an executable.
+ */
+static void header_read(const char *file, entry_t *entry)
+{
+    char buf[HEADER_SIZE + 1];
+
+    const char *line, *end;
+
+    int fd, lsb = 0;
+
+    ssize_t n;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+        return;
+    }
+
+    do {
+        n = read(fd, buf, HEADER_SIZE);
+    } while (n == -1 && errno == EINTR);
+
+    close(fd);
+
+    if (n < 0) {
+        return;
+    }
+
+    buf[n] = 0;
+
+    for (line = buf; line < buf + n; line = end + 1) {
+
+        const char *value;
+
+        end = memchr(line, '\n', buf + n - line);
+        if (!end) {
+            end = buf + n;
+        }
+
+        if (*line != '#') {
+            continue;
+        }
+
+        if (header_field(line, end, "### BEGIN INIT INFO")) {
+            entry->declared = lsb = 1;
+            continue;
+        }
+
+        if (header_field(line, end, "### END INIT INFO")) {
+            lsb = 0;
+            continue;
+        }
+
+        line += strspn(line, "# \t");
+        if (line > end) {
+            line = end;
+        }
+
+        if ((value = header_field(line, end, "sequence-after:"))) {
+            entry->requires = header_add(entry->requires, value, end - value);
+            entry->declared = 1;
+        }
+        else if (!lsb) {
+            continue;
+        }
+        else if ((value = header_field(line, end, "Provides:"))) {
+            entry->provides = header_add(entry->provides, value, end - value);
+        }
+        else if ((value = header_field(line, end, "Required-Start:"))) {
+            entry->requires = header_add(entry->requires, value, end - value);
+        }
+        else if ((value = header_field(line, end, "Should-Start:"))) {
+            entry->wants = header_add(entry->wants, value, end - value);
+        }
+
+    }
+
+}
+
+/*
+ * Does the space separated list contain the given word?
+ */
+static int header_contains(const char *list, const char *word)
+{
+    size_t len = strlen(word);
+
+    while (list && *list) {
+
+        size_t l;
+
+        list += strspn(list, " \t\r");
+        l = strcspn(list, " \t\r");
+
+        if (l == len && !memcmp(list, word, len)) {
+            return 1;
+        }
+
+        list += l;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the executable with the given name, or that provides the name.
+ */
+static size_t header_resolve(name_t *names, entry_t *entries,
+        size_t count, const char *word)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!strcmp(names[i].name, word)) {
+            return i;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (header_contains(entries[i].provides, word)) {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Turn the dependency names of an executable into a list of executables
+ * to wait for.
+ */
+static int header_link(sequence_t *seq, name_t *names,
+        entry_t *entries, size_t count, size_t index, char *list,
+        int required)
+{
+    entry_t *entry = &entries[index];
+
+    char *word, *state;
+
+    int rv = 0;
+
+    for (word = strtok_r(list, " \t\r", &state); word;
+            word = strtok_r(NULL, " \t\r", &state)) {
+
+        size_t *after, j;
+
+        /* LSB facilities like $network are not ours to satisfy */
+        if (word[0] == '$') {
+            continue;
+        }
+
+        j = header_resolve(names, entries, count, word);
+
+        if (j == count) {
+            if (required) {
+                notice(seq, "'%s' depends on '%s', which was not found",
+                        names[index].name, word);
+                rv = 1;
+            }
+            continue;
+        }
+
+        if (j == index) {
+            continue;
+        }
+
+        after = realloc(entry->after, (entry->nafter + 1) * sizeof(size_t));
+        if (!after) {
+            notice(seq, "Out of memory");
+            return 1;
+        }
+
+        entry->after = after;
+        entry->after[entry->nafter++] = j;
+    }
+
+    return rv;
+}
+
+/*
+ * Can this executable be started yet?
+ *
+ * Declared dependencies must have succeeded, while the executables
+ * without headers only need the one before them to have finished.
+ */
+static int depends_ready(entry_t *entries, size_t index)
+{
+    entry_t *entry = &entries[index];
+
+    size_t i;
+
+    if (entry->state != ENTRY_WAITING) {
+        return 0;
+    }
+
+    for (i = 0; i < entry->nafter; i++) {
+
+        int state = entries[entry->after[i]].state;
+
+        if (state != ENTRY_DONE &&
+                (state != ENTRY_FAILED || entry->declared)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Read the dependency headers of all executables, and make sure
+ * every executable can be reached before we run anything.
+ */
+static entry_t *depends_scan(sequence_t *seq, name_t *names, size_t count)
+{
+    entry_t *entries = calloc(count + 1, sizeof(entry_t));
+
+    size_t i, last = count, started;
+
+    int rv = 0;
+
+    if (!entries) {
+        notice(seq, "Out of memory");
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        header_read(names[i].name, &entries[i]);
+    }
+
+    for (i = 0; i < count; i++) {
+
+        /* undeclared executables follow one another as they always have */
+        if (!entries[i].declared) {
+            if (last < count) {
+                entries[i].after = malloc(sizeof(size_t));
+                if (!entries[i].after) {
+                    notice(seq, "Out of memory");
+                    rv = 1;
+                    break;
+                }
+                entries[i].after[entries[i].nafter++] = last;
+            }
+            last = i;
+            continue;
+        }
+
+        rv |= header_link(seq, names, entries, count, i, entries[i].requires, 1);
+        rv |= header_link(seq, names, entries, count, i, entries[i].wants, 0);
+    }
+
+    /*
+     * Dry run the schedule, anything left over is part of a cycle. Missing
+     * dependencies were never linked, so cycles are reported alongside them.
+     */
+    do {
+        started = 0;
+        for (i = 0; i < count; i++) {
+            if (depends_ready(entries, i)) {
+                entries[i].state = ENTRY_DONE;
+                started++;
+            }
+        }
+    } while (started);
+
+    for (i = 0; i < count; i++) {
+        if (entries[i].state == ENTRY_WAITING) {
+            notice(seq, "'%s' can never start, its dependencies form a cycle",
+                    names[i].name);
+            started++;
+        }
+    }
+
+    rv |= (started != 0);
+
+    for (i = 0; i < count; i++) {
+        free(entries[i].provides);
+        free(entries[i].requires);
+        free(entries[i].wants);
+        entries[i].provides = entries[i].requires = entries[i].wants = NULL;
+        entries[i].state = ENTRY_WAITING;
+    }
+
+    if (rv) {
+        for (i = 0; i < count; i++) {
+            free(entries[i].after);
+        }
+        free(entries);
+        return NULL;
+    }
+
+    return entries;
+}
+
+static int record_cmp(const void *p1, const void *p2)
+{
+    return strcmp(((const record_t *) p1)->name, ((const record_t *) p2)->name);
+}
+
+/*
+ * Open the checkpoint file. When resuming, read back what the previous
+ * run recorded, keeping the last line for each executable.
+ */
+static int checkpoint_open(sequence_t *seq)
+{
+    struct stat st;
+
+    char *buf, *line, *end;
+
+    size_t i, n = 0;
+
+    seq->checkpointfd = open(seq->checkpoint, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+            0644);
+    if (seq->checkpointfd == -1) {
+        notice(seq, "Could not open '%s': %s",
+                seq->checkpoint, strerror(errno));
+        return -1;
+    }
+
+    if (flock(seq->checkpointfd, LOCK_EX | LOCK_NB)) {
+        notice(seq, "Could not lock '%s': %s",
+                seq->checkpoint, strerror(errno));
+        return -1;
+    }
+
+    if (!seq->resume) {
+        return ftruncate(seq->checkpointfd, 0);
+    }
+
+    if (fstat(seq->checkpointfd, &st)) {
+        return -1;
+    }
+
+    buf = malloc(st.st_size + 1);
+    if (!buf) {
+        notice(seq, "Out of memory");
+        return -1;
+    }
+
+    while (n < (size_t)st.st_size) {
+        ssize_t r = pread(seq->checkpointfd, buf + n, st.st_size - n, n);
+        if (r <= 0) {
+            break;
+        }
+        n += r;
+    }
+
+    buf[n] = 0;
+
+    for (line = buf; *line; line = end + 1) {
+
+        record_t r;
+        unsigned long long dev, ino;
+        long long sec;
+        long nsec;
+        int pos = 0;
+
+        end = strchr(line, '\n');
+
+        /* a torn last line is ignored */
+        if (!end) {
+            break;
+        }
+
+        *end = 0;
+
+        if (sscanf(line, "%d %llu %llu %lld.%ld %n", &r.code, &dev, &ino,
+                &sec, &nsec, &pos) < 5 || !pos || !line[pos]) {
+            continue;
+        }
+
+        r.name = line + pos;
+        r.dev = dev;
+        r.ino = ino;
+        r.mtime.tv_sec = sec;
+        r.mtime.tv_nsec = nsec;
+
+        /* later lines replace earlier ones */
+        for (i = 0; i < seq->nrecords; i++) {
+            if (!strcmp(seq->records[i].name, r.name)) {
+                break;
+            }
+        }
+
+        if (i == seq->nrecords) {
+            record_t *records = realloc(seq->records,
+                    (seq->nrecords + 1) * sizeof(record_t));
+            if (!records) {
+                notice(seq, "Out of memory");
+                return -1;
+            }
+            seq->records = records;
+            seq->nrecords++;
+        }
+
+        seq->records[i] = r;
+    }
+
+    qsort(seq->records, seq->nrecords, sizeof(record_t), record_cmp);
+
+    /* the names point into buf, which we keep for the life of the run */
+    return 0;
+}
+
+/*
+ * Did this executable succeed last time, and is it unchanged since?
+ */
+static int checkpoint_done(sequence_t *seq, const char *name,
+        const struct stat *st)
+{
+    record_t key, *r;
+
+    key.name = (char *)name;
+
+    r = bsearch(&key, seq->records, seq->nrecords, sizeof(record_t),
+            record_cmp);
+
+    return r && !r->code && r->dev == st->st_dev && r->ino == st->st_ino &&
+            r->mtime.tv_sec == st->st_mtim.tv_sec &&
+            r->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Record how an executable went. The write is made durable later, once
+ * for each batch of children that finish together.
+ */
+static void checkpoint_write(sequence_t *seq, const char *name,
+        const struct stat *st, int code)
+{
+    char buf[PATH_MAX + 128];
+
+    int len;
+
+    /* a name we cannot write on a line is simply run again */
+    if (strchr(name, '\n')) {
+        return;
+    }
+
+    len = snprintf(buf, sizeof(buf), "%d %llu %llu %lld.%09ld %s\n", code,
+            (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+            (long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec, name);
+    if (len < 0 || len >= (int)sizeof(buf)) {
+        return;
+    }
+
+    if (write(seq->checkpointfd, buf, len) != len) {
+        notice(seq, "Could not write to '%s': %s",
+                seq->checkpoint, strerror(errno));
+        return;
+    }
+
+    seq->dirty = 1;
+}
+
+static void checkpoint_sync(sequence_t *seq)
+{
+    if (seq->checkpointfd != -1 && seq->dirty) {
+        fdatasync(seq->checkpointfd);
+        seq->dirty = 0;
+    }
+}
+
+/*
+ * Work out the cache key of an executable, from its contents, owner,
+ * permissions, arguments and chosen environment. Where the executable
+ * was opened when listed, it is read through that descriptor, so that
+ * what we hash is what we would run. Returns -1 if the executable cannot
+ * be read, or if we would not be allowed to run it, in which case it is
+ * left to spawn() to say why.
+ */
+static int cache_key(sequence_t *seq, const char *file, int exec,
+        char **args, uint64_t *key)
+{
+    char buf[65536], path[32];
+
+    struct stat st;
+
+    uint64_t h = FNV_OFFSET;
+
+    ssize_t n;
+
+    size_t i;
+
+    int fd;
+
+    if (exec != -1) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", exec);
+        file = path;
+    }
+
+    if (faccessat(AT_FDCWD, file, X_OK, AT_EACCESS)) {
+        return -1;
+    }
+
+    fd = open(file, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1 || fstat(fd, &st)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    h = fnv(h, &st.st_mode, sizeof(st.st_mode));
+    h = fnv(h, &st.st_uid, sizeof(st.st_uid));
+    h = fnv(h, &st.st_gid, sizeof(st.st_gid));
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        h = fnv(h, buf, n);
+    }
+
+    close(fd);
+
+    for (i = 0; args[i]; i++) {
+        h = fnv(h, args[i], strlen(args[i]) + 1);
+    }
+
+    for (i = 0; i < seq->ncacheenv; i++) {
+
+        const char *value = getenv(seq->cacheenv[i]);
+
+        h = fnv(h, seq->cacheenv[i], strlen(seq->cacheenv[i]) + 1);
+        if (value) {
+            h = fnv(h, value, strlen(value) + 1);
+        }
+        else {
+            h = fnv(h, "\1", 1);
+        }
+    }
+
+    *key = h;
+
+    return 0;
+}
+
+/*
+ * Is there a fresh cached result for this child? If so, replay its
+ * stderr, and leave its exit status behind as if it had just run.
+ */
+static int cache_replay(sequence_t *seq, child_t *child)
+{
+    struct stat st;
+
+    char name[32], *buf, *data;
+
+    long long created;
+
+    unsigned long len;
+
+    int fd, status, pos = 0;
+
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)child->key);
+
+    fd = openat(seq->cachefd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+            (size_t)st.st_size > seq->cachesize) {
+        close(fd);
+        return 0;
+    }
+
+    buf = malloc(st.st_size + 1);
+    if (!buf) {
+        close(fd);
+        return 0;
+    }
+
+    if (read(fd, buf, st.st_size) != st.st_size) {
+        free(buf);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+
+    buf[st.st_size] = 0;
+
+    if (sscanf(buf, CACHE_MAGIC " %d %lld %lu\n%n", &status, &created, &len,
+            &pos) < 3 || !pos || pos + len != (unsigned long)st.st_size ||
+            (time(NULL) - created) * NANOSECONDS >= seq->ttl) {
+        free(buf);
+        return 0;
+    }
+
+    data = buf + pos;
+
+    if (len) {
+        relay(seq, child, data, len);
+        relay_end(seq, child);
+    }
+
+    free(buf);
+
+    child->status = status;
+    child->reaped = 1;
+    child->error = 0;
+    child->timedout = 0;
+
+    return 1;
+}
+
+/*
+ * Hold on to what the child wrote to stderr, while it still fits.
+ */
+static void cache_capture(sequence_t *seq, child_t *child, const char *buf,
+        size_t len)
+{
+    char *capture;
+
+    if (!child->cacheable) {
+        return;
+    }
+
+    if (child->captured + len > seq->cachesize) {
+        child->cacheable = 0;
+        return;
+    }
+
+    capture = realloc(child->capture, child->captured + len);
+    if (!capture) {
+        child->cacheable = 0;
+        return;
+    }
+
+    memcpy(capture + child->captured, buf, len);
+
+    child->capture = capture;
+    child->captured += len;
+}
+
+/*
+ * Store the result of a child that exited by itself. The file is
+ * written to the side and renamed into place, so a reader never sees
+ * half a result.
+ */
+static void cache_store(sequence_t *seq, child_t *child)
+{
+    char name[32], tmp[64], header[128];
+
+    int fd, len, ok;
+
+    if (!child->cacheable || child->timedout || child->error ||
+            !WIFEXITED(child->status)) {
+        return;
+    }
+
+    len = snprintf(header, sizeof(header), CACHE_MAGIC " %d %lld %lu\n",
+            child->status, (long long)time(NULL),
+            (unsigned long)child->captured);
+
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)child->key);
+    snprintf(tmp, sizeof(tmp), ".%s.%ld", name, (long)getpid());
+
+    fd = openat(seq->cachefd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0600);
+    if (fd == -1) {
+        return;
+    }
+
+    ok = write(fd, header, len) == len &&
+            write(fd, child->capture, child->captured) ==
+                    (ssize_t)child->captured;
+
+    close(fd);
+
+    if (!ok || renameat(seq->cachefd, tmp, seq->cachefd, name)) {
+        unlinkat(seq->cachefd, tmp, 0);
+    }
+
+}
+
+typedef struct cached_t {
+    char name[32];
+    time_t mtime;
+    off_t size;
+} cached_t;
+
+static int cached_cmp(const void *p1, const void *p2)
+{
+    const cached_t *c1 = p1, *c2 = p2;
+
+    return (c1->mtime > c2->mtime) - (c1->mtime < c2->mtime);
+}
+
+/*
+ * Remove expired results, and then the oldest results until the cache
+ * fits within its size.
+ */
+static void cache_trim(sequence_t *seq)
+{
+    struct dirent *de;
+
+    cached_t *cached = NULL;
+
+    size_t count = 0, i;
+
+    off_t total = 0;
+
+    time_t now = time(NULL);
+
+    DIR *dh;
+
+    int fd;
+
+    fd = openat(seq->cachefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || !(dh = fdopendir(fd))) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    while ((de = readdir(dh))) {
+
+        struct stat st;
+
+        cached_t *c;
+
+        if (strlen(de->d_name) != 16 ||
+                strspn(de->d_name, "0123456789abcdef") != 16) {
+            continue;
+        }
+
+        if (fstatat(seq->cachefd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+                !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        if ((now - st.st_mtime) * NANOSECONDS >= seq->ttl) {
+            unlinkat(seq->cachefd, de->d_name, 0);
+            continue;
+        }
+
+        c = realloc(cached, (count + 1) * sizeof(cached_t));
+        if (!c) {
+            break;
+        }
+        cached = c;
+
+        c = &cached[count++];
+        strcpy(c->name, de->d_name);
+        c->mtime = st.st_mtime;
+        c->size = st.st_size;
+
+        total += st.st_size;
+    }
+
+    closedir(dh);
+
+    qsort(cached, count, sizeof(cached_t), cached_cmp);
+
+    for (i = 0; i < count && (size_t)total > seq->cachesize; i++) {
+        if (!unlinkat(seq->cachefd, cached[i].name, 0)) {
+            total -= cached[i].size;
+        }
+    }
+
+    free(cached);
+}
+
+/*
+ * Work out a hash of the options that change what a manifest holds, the
+ * way names are filtered and the order they are sorted into.
+ */
+static uint64_t manifest_options(sequence_t *seq)
+{
+    uint64_t h = FNV_OFFSET;
+
+    h = fnv(h, &seq->ignore, sizeof(seq->ignore));
+    h = fnv(h, &seq->sort, sizeof(seq->sort));
+
+    if (seq->sort == SORT_LOCALE) {
+        const char *collate = setlocale(LC_COLLATE, NULL);
+        if (collate) {
+            h = fnv(h, collate, strlen(collate));
+        }
+    }
+
+    return h;
+}
+
+/*
+ * Open the directory the manifest lives in, so that we can find the
+ * manifest again once we have changed directory.
+ */
+static int manifest_open(sequence_t *seq)
+{
+    const char *slash = strrchr(seq->manifest, '/');
+
+    char *dir;
+
+    if (!slash) {
+        dir = strdup(".");
+        seq->manifestname = seq->manifest;
+    }
+    else {
+        dir = strndup(seq->manifest, slash == seq->manifest ? 1 :
+                slash - seq->manifest);
+        seq->manifestname = slash + 1;
+    }
+
+    if (!dir) {
+        notice(seq, "Out of memory");
+        return -1;
+    }
+
+    seq->manifestfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (seq->manifestfd == -1 || !seq->manifestname[0]) {
+        notice(seq, "Could not open manifest '%s': %s",
+                seq->manifest, seq->manifestfd == -1 ? strerror(errno) :
+                "Is a directory");
+        free(dir);
+        return -1;
+    }
+
+    free(dir);
+
+    return 0;
+}
+
+/*
+ * Fill the table from the manifest, if the manifest is still true of
+ * the directory. Anything that does not add up sends us back to a full
+ * scan of the directory.
+ */
+static int manifest_load(sequence_t *seq, const struct stat *dst,
+        const char *dirname, table_t *table)
+{
+    const manifest_t *m;
+
+    const char *names, *name, *end;
+
+    struct stat st;
+
+    size_t dirlen = strlen(dirname), count = 0;
+
+    void *map;
+
+    int fd, ok = 0;
+
+    fd = openat(seq->manifestfd, seq->manifestname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+            st.st_size < (off_t)sizeof(manifest_t)) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    m = map;
+    names = (const char *)map + sizeof(manifest_t);
+    end = names + (st.st_size - sizeof(manifest_t));
+
+    if (memcmp(m->magic, MANIFEST_MAGIC, sizeof(m->magic)) ||
+            m->dev != dst->st_dev || m->ino != dst->st_ino ||
+            m->mtime_sec != dst->st_mtim.tv_sec ||
+            m->mtime_nsec != dst->st_mtim.tv_nsec ||
+            m->ctime_sec != dst->st_ctim.tv_sec ||
+            m->ctime_nsec != dst->st_ctim.tv_nsec ||
+            m->options != manifest_options(seq) ||
+            m->size != (uint64_t)(end - names) ||
+            (m->size && end[-1]) ||
+            m->sum != fnv(FNV_OFFSET, names, m->size)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    for (name = names; name < end; name += strlen(name) + 1) {
+
+        if (!name[0] || name[0] == '.' || strchr(name, '/')) {
+            break;
+        }
+
+        if (table_add(table, dirname, dirlen, name)) {
+            notice(seq, "Out of memory");
+            break;
+        }
+
+        count++;
+    }
+
+    ok = name == end && count == m->count;
+
+    munmap(map, st.st_size);
+
+    if (!ok) {
+        table->count = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the manifest of a directory we have just scanned, to the side
+ * and renamed into place.
+ *
+ * The directory must be unchanged since before the scan, and must not
+ * have changed within the last two seconds, as a change made within the
+ * same tick of a coarse filesystem clock as our scan would leave the
+ * times untouched.
+ */
+static void manifest_save(sequence_t *seq, int dfd, const struct stat *dst,
+        table_t *table)
+{
+    manifest_t m;
+
+    struct stat st;
+
+    struct iovec iov[2];
+
+    char tmp[PATH_MAX], *names, *p;
+
+    size_t i, size = 0;
+
+    int fd, ok;
+
+    if (fstat(dfd, &st) || st.st_mtim.tv_sec != dst->st_mtim.tv_sec ||
+            st.st_mtim.tv_nsec != dst->st_mtim.tv_nsec ||
+            st.st_ctim.tv_sec != dst->st_ctim.tv_sec ||
+            st.st_ctim.tv_nsec != dst->st_ctim.tv_nsec ||
+            time(NULL) - st.st_mtim.tv_sec < 2 ||
+            time(NULL) - st.st_ctim.tv_sec < 2) {
+        return;
+    }
+
+    for (i = 0; i < table->count; i++) {
+        size += table->names[i].len + 1;
+    }
+
+    names = p = malloc(size ? size : 1);
+    if (!names) {
+        return;
+    }
+
+    for (i = 0; i < table->count; i++) {
+        memcpy(p, table->names[i].name, table->names[i].len + 1);
+        p += table->names[i].len + 1;
+    }
+
+    memset(&m, 0, sizeof(m));
+    memcpy(m.magic, MANIFEST_MAGIC, sizeof(m.magic));
+    m.dev = st.st_dev;
+    m.ino = st.st_ino;
+    m.mtime_sec = st.st_mtim.tv_sec;
+    m.mtime_nsec = st.st_mtim.tv_nsec;
+    m.ctime_sec = st.st_ctim.tv_sec;
+    m.ctime_nsec = st.st_ctim.tv_nsec;
+    m.options = manifest_options(seq);
+    m.count = table->count;
+    m.size = size;
+    m.sum = fnv(FNV_OFFSET, names, size);
+
+    snprintf(tmp, sizeof(tmp), ".%s.%ld", seq->manifestname, (long)getpid());
+
+    fd = openat(seq->manifestfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+    if (fd == -1) {
+        free(names);
+        return;
+    }
+
+    iov[0].iov_base = &m;
+    iov[0].iov_len = sizeof(m);
+    iov[1].iov_base = names;
+    iov[1].iov_len = size;
+
+    ok = writev(fd, iov, 2) == (ssize_t)(sizeof(m) + size);
+
+    close(fd);
+    free(names);
+
+    if (!ok || renameat(seq->manifestfd, tmp, seq->manifestfd,
+            seq->manifestname)) {
+        unlinkat(seq->manifestfd, tmp, 0);
+    }
+
+}
+
+/*
+ * Print the summary of each executable that was run.
+ */
+static void summary(sequence_t *seq, run_t *run)
+{
+    size_t i;
+
+    if (seq->format == SUMMARY_TSV) {
+        fprintf(stderr, "executable\tstatus\tspawn_us\twall_s\tuser_s\tsys_s\t"
+                "maxrss_kb\tmajflt\tminflt\tnvcsw\tnivcsw\tblocked\n");
+    }
+    else {
+        fprintf(stderr, "%s: %9s %9s %9s %9s %10s %7s %8s %8s %8s %7s %6s %s\n",
+                seq->name, "spawn(us)", "wall(s)", "user(s)", "sys(s)",
+                "maxrss(kB)", "majflt", "minflt", "nvcsw", "nivcsw", "blocked",
+                "status", "executable");
+    }
+
+    for (i = 0; i < run->count; i++) {
+
+        result_t *r = &run->results[i];
+
+        struct rusage *u = &r->usage;
+
+        if (!r->ran) {
+            continue;
+        }
+
+        if (seq->format == SUMMARY_TSV) {
+            fprintf(stderr, "%s\t%d\t%.1f\t%.6f\t%ld.%06ld\t%ld.%06ld\t"
+                    "%ld\t%ld\t%ld\t%ld\t%ld\t%ld\n",
+                    run->names[i].path, r->code, r->latency / 1000.0,
+                    (double)r->wall / NANOSECONDS,
+                    (long)u->ru_utime.tv_sec, (long)u->ru_utime.tv_usec,
+                    (long)u->ru_stime.tv_sec, (long)u->ru_stime.tv_usec,
+                    u->ru_maxrss, u->ru_majflt, u->ru_minflt, u->ru_nvcsw,
+                    u->ru_nivcsw, r->blocked);
+        }
+        else {
+            fprintf(stderr, "%s: %9.1f %9.3f %5ld.%03ld %5ld.%03ld %10ld %7ld "
+                    "%8ld %8ld %8ld %7ld %6d %s\n",
+                    seq->name, r->latency / 1000.0,
+                    (double)r->wall / NANOSECONDS,
+                    (long)u->ru_utime.tv_sec, (long)u->ru_utime.tv_usec / 1000,
+                    (long)u->ru_stime.tv_sec, (long)u->ru_stime.tv_usec / 1000,
+                    u->ru_maxrss, u->ru_majflt, u->ru_minflt, u->ru_nvcsw,
+                    u->ru_nivcsw, r->blocked, r->code, run->names[i].path);
+        }
+    }
+
+}
+
+/*
+ * Mark the executables that never ran because something they depend on
+ * failed, as opposed to those the total timeout left waiting.
+ */
+static void depends_blocked(entry_t *entries, size_t count)
+{
+    size_t i, j;
+
+    int changed = 1;
+
+    while (changed) {
+
+        changed = 0;
+
+        for (i = 0; i < count; i++) {
+
+            entry_t *entry = &entries[i];
+
+            if (entry->state != ENTRY_WAITING) {
+                continue;
+            }
+
+            for (j = 0; j < entry->nafter; j++) {
+
+                int state = entries[entry->after[j]].state;
+
+                if (state == ENTRY_BLOCKED ||
+                        (state == ENTRY_FAILED && entry->declared)) {
+                    entry->state = ENTRY_BLOCKED;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * List the executables that failed, those that never ran because
+ * something they depend on failed, and those the total timeout stopped
+ * from running.
+ */
+static void failures(sequence_t *seq, run_t *run)
+{
+    size_t i, failed = 0, skipped = 0, expired = 0;
+
+    if (run->entries) {
+        depends_blocked(run->entries, run->count);
+    }
+
+    for (i = 0; i < run->count; i++) {
+        if (run->results[i].ran && run->results[i].code) {
+            failed++;
+        }
+        else if (run->entries && run->entries[i].state == ENTRY_BLOCKED) {
+            skipped++;
+        }
+        else if (run->expired && (run->entries ?
+                run->entries[i].state == ENTRY_WAITING : i >= run->next)) {
+            expired++;
+        }
+    }
+
+    if (failed) {
+        fprintf(stderr, "%s: %zu of %zu failed:", seq->name, failed, run->count);
+        for (i = 0; i < run->count; i++) {
+            if (run->results[i].ran && run->results[i].code) {
+                fprintf(stderr, " %s (%d)", run->names[i].path,
+                        run->results[i].code);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (skipped) {
+        fprintf(stderr, "%s: %zu not run, a dependency failed:", seq->name,
+                skipped);
+        for (i = 0; i < run->count; i++) {
+            if (run->entries[i].state == ENTRY_BLOCKED) {
+                fprintf(stderr, " %s", run->names[i].path);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (expired) {
+        fprintf(stderr, "%s: %zu not run, the run timed out:", seq->name,
+                expired);
+        for (i = 0; i < run->count; i++) {
+            if (run->entries ?
+                    run->entries[i].state == ENTRY_WAITING : i >= run->next) {
+                fprintf(stderr, " %s", run->names[i].path);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+}
+
+/*
+ * An executable is done, take note of how it went.
+ */
+static void complete(sequence_t *seq, run_t *run, child_t *child, int code)
+{
+    if (code != EXIT_SUCCESS && child->index < run->failed) {
+        run->failed = child->index;
+        run->result = code;
+    }
+
+    if (run->entries) {
+        run->entries[child->index].state = code ? ENTRY_FAILED : ENTRY_DONE;
+    }
+
+    if (seq->checkpointfd != -1) {
+        checkpoint_write(seq, run->names[child->index].name, &child->st, code);
+    }
+
+    if (run->results) {
+        result_t *r = &run->results[child->index];
+
+        r->ran = 1;
+        r->code = code;
+        r->latency = child->latency;
+        r->wall = child->pid && child->reaped ? child->exited - child->started : 0;
+        r->blocked = child->blocked;
+        r->usage = child->usage;
+    }
+
+    if (seq->output != OUTPUT_TEXT) {
+        output_event(seq, child, EVENT_EXIT, code, NULL);
+    }
+
+    child->path = NULL;
+
+    free(child->capture);
+    child->capture = NULL;
+    child->captured = 0;
+    child->cacheable = 0;
+
+    free(child->partial);
+    child->partial = NULL;
+    child->partiallen = 0;
+    child->partialsize = 0;
+
+    free(child->record);
+    child->record = NULL;
+    child->recordstart = 0;
+    child->recordlen = 0;
+    child->recordsize = 0;
+    child->recordopen = 0;
+
+    free(child->last);
+    child->last = NULL;
+    child->lastlen = 0;
+    child->lastsize = 0;
+    child->repeats = 0;
+    child->dropped = 0;
+    child->droppedbytes = 0;
+    memset(&child->bucket, 0, sizeof(child->bucket));
+}
+
+/*
+ * Read the given signals from a signalfd in the epoll loop, rather than
+ * have them arrive at some awkward moment.
+ */
+static int signals(sequence_t *seq, run_t *run, sigset_t *set)
+{
+    struct epoll_event ev = { 0 };
+
+    run->sigfd = signalfd(-1, set, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (run->sigfd == -1) {
+        notice(seq, "Could not create signalfd: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = TOKEN_SIGNAL;
+
+    if (epoll_ctl(run->epfd, EPOLL_CTL_ADD, run->sigfd, &ev)) {
+        notice(seq, "Could not watch signalfd: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Watch the stderr pipe and the pidfd of a new child. Children without
+ * a pidfd are reaped when SIGCHLD shows up on the signalfd instead, and
+ * children writing straight to our stderr have no pipe.
+ */
+static int watch(sequence_t *seq, run_t *run, child_t *child)
+{
+    struct epoll_event ev = { 0 };
+
+    uint64_t slot = child - run->children;
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = (slot << TOKEN_SHIFT) | TOKEN_PIPE;
+
+    /* while syslog catches up, log_pause() adds the pipe later */
+    if (child->fd != -1 && !run->paused &&
+            epoll_ctl(run->epfd, EPOLL_CTL_ADD, child->fd, &ev)) {
+        notice(seq, "Could not watch '%s': %s",
+                child->path, strerror(errno));
+        return -1;
+    }
+
+    ev.data.u64 = (slot << TOKEN_SHIFT) | TOKEN_STDOUT;
+
+    if (child->outfd != -1 &&
+            epoll_ctl(run->epfd, EPOLL_CTL_ADD, child->outfd, &ev)) {
+        notice(seq, "Could not watch '%s': %s",
+                child->path, strerror(errno));
+        return -1;
+    }
+
+    if (child->pidfd != -1) {
+
+        ev.data.u64 = (slot << TOKEN_SHIFT) | TOKEN_PIDFD;
+
+        if (!epoll_ctl(run->epfd, EPOLL_CTL_ADD, child->pidfd, &ev)) {
+            return 0;
+        }
+
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+
+    if (run->sigfd == -1) {
+
+        sigset_t chld;
+
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+
+        if (signals(seq, run, &chld)) {
+            return -1;
+        }
+    }
+
+    /* the child may have exited before we started to watch */
+    reap(child);
+
+    return 0;
+}
+
+/*
+ * Read what the child has to say, one buffer at a time so that all
+ * children get their turn. Returns zero at end of file.
+ */
+static int drain(sequence_t *seq, run_t *run, child_t *child)
+{
+    size_t size;
+
+    int n;
+
+    /* read as much as the pipe can hold */
+    if (run->bufsize < (size_t)child->pipesize) {
+        char *buf = realloc(run->buf, child->pipesize);
+        if (buf) {
+            run->buf = buf;
+            run->bufsize = child->pipesize;
+        }
+    }
+
+    size = run->bufsize < (size_t)child->pipesize ? run->bufsize :
+            (size_t)child->pipesize;
+
+    /* read our child's stderr, redirect to syslog or prefix with script name */
+    n = read(child->fd, run->buf, size);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    }
+    if (n > 0) {
+
+        /* the pipe was full, the child had to wait for us */
+        if (n == child->pipesize) {
+            child->blocked++;
+            pipe_grow(seq, child);
+        }
+
+        relay(seq, child, run->buf, n);
+        cache_capture(seq, child, run->buf, n);
+        return 1;
+    }
+
+    relay_end(seq, child);
+
+    epoll_ctl(run->epfd, EPOLL_CTL_DEL, child->fd, NULL);
+    close(child->fd);
+    child->fd = -1;
+
+    return 0;
+}
+
+/*
+ * Pass on what a child that might be cached wrote to stdout. A child
+ * that writes to stdout is not cached after all, as the cache only
+ * replays stderr.
+ */
+static int drain_stdout(run_t *run, child_t *child)
+{
+    int n = read(child->outfd, run->buf, run->bufsize);
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    }
+    if (n > 0) {
+
+        const char *p = run->buf;
+
+        while (n > 0) {
+
+            ssize_t w = write(STDOUT_FILENO, p, n);
+
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            p += w;
+            n -= w;
+        }
+
+        child->cacheable = 0;
+        return 1;
+    }
+
+    epoll_ctl(run->epfd, EPOLL_CTL_DEL, child->outfd, NULL);
+    close(child->outfd);
+    child->outfd = -1;
+
+    return 0;
+}
+
+/*
+ * Once the child has exited and closed its end of the pipe, the
+ * child is done and the slot can be reused.
+ */
+static void finish(sequence_t *seq, run_t *run, child_t *child)
+{
+    if (child->fd != -1 || child->outfd != -1 || !child->reaped) {
+        return;
+    }
+
+    if (child->pidfd != -1) {
+        epoll_ctl(run->epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+
+    /* take back the terminal we lent it */
+    if (seq->foreground) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    cache_store(seq, child);
+
+    complete(seq, run, child, decode(seq, child));
+
+    child->pid = 0;
+
+    run->running--;
+}
+
+/*
+ * Which executable goes next? Returns run->count if none can go yet.
+ */
+static size_t pick(sequence_t *seq, run_t *run)
+{
+    size_t i;
+
+    if (run->next >= run->count || run->expired ||
+            (run->failed < run->count && !seq->keepgoing)) {
+        return run->count;
+    }
+
+    /* the first executable whose dependencies are done goes next */
+    if (run->entries) {
+
+        for (i = run->next; i < run->count; i++) {
+            if (depends_ready(run->entries, i)) {
+                return i;
+            }
+        }
+
+        return run->count;
+    }
+
+    /* the stage barrier: wait for the current stage to drain */
+    if (seq->stages && run->running &&
+            !same_stage(run->names[run->stage].name, run->names[run->next].name)) {
+        return run->count;
+    }
+
+    return run->next;
+}
+
+/*
+ * Start as many executables as the pool allows.
+ */
+static void start(sequence_t *seq, run_t *run)
+{
+    while (run->running < seq->jobs) {
+
+        child_t *child = run->children;
+
+        const char *name;
+
+        int code, fd;
+
+        while (child->path) {
+            child++;
+        }
+
+        child->index = pick(seq, run);
+        if (child->index == run->count) {
+            break;
+        }
+
+        name = run->names[child->index].name;
+        fd = run->names[child->index].fd;
+
+        if (!run->running) {
+            run->stage = child->index;
+        }
+
+        if (run->entries) {
+            run->entries[child->index].state = ENTRY_RUNNING;
+            while (run->next < run->count &&
+                    run->entries[run->next].state != ENTRY_WAITING) {
+                run->next++;
+            }
+        }
+        else {
+            run->next++;
+        }
+
+        child->path = run->names[child->index].path;
+
+        if (seq->checkpointfd != -1) {
+
+            if (fd != -1 ? fstat(fd, &child->st) : stat(name, &child->st)) {
+                memset(&child->st, 0, sizeof(child->st));
+            }
+
+            /* succeeded last time, nothing to do */
+            else if (seq->resume && checkpoint_done(seq, name, &child->st)) {
+                if (run->entries) {
+                    run->entries[child->index].state = ENTRY_DONE;
+                }
+                child->path = NULL;
+                continue;
+            }
+
+        }
+
+        if (seq->cachefd != -1) {
+
+            run->args[0] = child->path;
+
+            child->cacheable = !cache_key(seq, name, fd, run->args,
+                    &child->key);
+
+            /* an earlier run has already told us what happens */
+            if (child->cacheable && cache_replay(seq, child)) {
+                child->pid = 0;
+                complete(seq, run, child, decode(seq, child));
+                continue;
+            }
+
+        }
+
+        code = spawn(seq, child, name, fd, run->args);
+
+        /* the child has its own copy now, if it has anything at all */
+        if (fd != -1) {
+            close(fd);
+            run->names[child->index].fd = -1;
+        }
+
+        /* the executable never ran, it is already done */
+        if (!child->pid) {
+            complete(seq, run, child, code);
+            continue;
+        }
+
+        if (watch(seq, run, child)) {
+            if (child->fd != -1) {
+                close(child->fd);
+            }
+            if (child->outfd != -1) {
+                close(child->outfd);
+            }
+            if (child->pidfd != -1) {
+                close(child->pidfd);
+            }
+            child->pid = 0;
+            complete(seq, run, child, EXIT_FAILURE);
+            break;
+        }
+
+        run->running++;
+    }
+
+}
+
+/*
+ * Ask a child that has run out of time to stop, and if it ignores us,
+ * kill it. Either way, its whole process group is signalled so that
+ * nothing it started is left behind.
+ */
+static void stop(sequence_t *seq, child_t *child, long long now)
+{
+    if (!child->timedout) {
+        kill(-child->pid, SIGTERM);
+        child->timedout = 1;
+        child->deadline = now + seq->grace;
+    }
+    else {
+        kill(-child->pid, SIGKILL);
+        child->deadline = 0;
+    }
+}
+
+/*
+ * We have been asked to stop. Children with a timeout are in process
+ * groups of their own, out of reach of a signal sent to ours, so pass
+ * the signal on to each of them before going the same way ourselves.
+ */
+static void interrupt(sequence_t *seq, run_t *run, int sig)
+{
+    size_t i;
+
+    for (i = 0; i < seq->jobs; i++) {
+        if (run->children[i].pid) {
+            kill(-run->children[i].pid, sig);
+        }
+    }
+
+    if (seq->outlen) {
+        output_flush(seq);
+    }
+    checkpoint_sync(seq);
+
+    signal(sig, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &seq->mask, NULL);
+    raise(sig);
+
+    exit(128 + sig);
+}
+
+/*
+ * Lines are waiting for syslog. Have epoll tell us once syslog has room
+ * for them, with the timer in timeouts() in case it never says. While
+ * syslog takes lines but cannot keep up, we stop reading from the
+ * children, so that they wait on their full pipes rather than we wait on
+ * syslog, and timeouts are still seen to. Should syslog take nothing for
+ * a second, we read on, and the lines it cannot take are lost.
+ */
+static void log_backlog(sequence_t *seq, run_t *run)
+{
+    struct epoll_event ev = { 0 };
+
+    uint64_t slot;
+
+    int waiting = seq->logq && seq->logq->count;
+
+    int paused = waiting && seq->logfd != -1 &&
+            seq->logq->count >= SYSLOG_PAUSE &&
+            monotonic() - seq->logsent < NANOSECONDS;
+
+    /* a socket closed since is already gone from epoll */
+    if (!waiting || run->logfd != seq->logfd) {
+        if (run->logfd != -1 && run->logfd == seq->logfd) {
+            epoll_ctl(run->epfd, EPOLL_CTL_DEL, run->logfd, NULL);
+        }
+        run->logfd = -1;
+    }
+
+    if (waiting && seq->logfd != -1 && run->logfd == -1) {
+
+        ev.events = EPOLLOUT | EPOLLET;
+        ev.data.u64 = TOKEN_SYSLOG;
+
+        if (!epoll_ctl(run->epfd, EPOLL_CTL_ADD, seq->logfd, &ev)) {
+            run->logfd = seq->logfd;
+        }
+    }
+
+    if (paused == run->paused) {
+        return;
+    }
+
+    run->paused = paused;
+
+    ev.events = EPOLLIN;
+
+    for (slot = 0; slot < seq->jobs; slot++) {
+
+        child_t *child = &run->children[slot];
+
+        if (child->pid && child->fd != -1) {
+            ev.data.u64 = (slot << TOKEN_SHIFT) | TOKEN_PIPE;
+            epoll_ctl(run->epfd, paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD,
+                    child->fd, &ev);
+        }
+    }
+}
+
+/*
+ * Stop any children whose time is up, and return how long epoll may
+ * sleep before the next deadline, or -1 if there is none.
+ */
+static int timeouts(sequence_t *seq, run_t *run)
+{
+    long long now, next = 0, wait;
+
+    size_t i;
+
+    if (!seq->timeout && !seq->total && !seq->multiline &&
+            !(seq->logq && seq->logq->count)) {
+        return -1;
+    }
+
+    now = monotonic();
+
+    /* lines syslog could not take yet, and nothing else to send them */
+    if (seq->logq && seq->logq->count) {
+
+        if (now >= seq->logretry) {
+            log_flush(seq, 0);
+        }
+
+        if (seq->logq->count) {
+            next = seq->logretry;
+        }
+    }
+
+    if (run->deadline && !run->expired && now >= run->deadline) {
+        notice(seq, "run timed out, stopping");
+        run->expired = 1;
+    }
+
+    for (i = 0; i < seq->jobs; i++) {
+
+        child_t *child = &run->children[i];
+
+        if (!child->pid) {
+            continue;
+        }
+
+        if (run->expired && !child->timedout) {
+            stop(seq, child, now);
+        }
+        else if (child->deadline && now >= child->deadline) {
+            stop(seq, child, now);
+        }
+
+        if (child->deadline && (!next || child->deadline < next)) {
+            next = child->deadline;
+        }
+
+        /* a record waiting for lines that may never come */
+        if (child->recordopen) {
+
+            if (now >= child->recorded + seq->idle) {
+                relay_idle(seq, child);
+            }
+            else if (!next || child->recorded + seq->idle < next) {
+                next = child->recorded + seq->idle;
+            }
+        }
+    }
+
+    if (run->deadline && !run->expired && (!next || run->deadline < next)) {
+        next = run->deadline;
+    }
+
+    if (!next) {
+        return -1;
+    }
+
+    /* round up, so we do not wake a moment too early */
+    wait = (next - now + 999999) / 1000000;
+
+    /* epoll takes an int, a deadline weeks away must not wrap around */
+    return wait > INT_MAX ? INT_MAX : wait;
+}
+
+/*
+ * Run the executables, keeping up to seq->jobs of them running at once.
+ *
+ * Executables are started in the sorted order. Once an executable fails
+ * we start nothing further, wait for those still running, and return
+ * the result of the failed executable that sorts first. When keeping
+ * going, we start everything that can still be started instead.
+ *
+ * With stages, an executable is only started alongside those in its own
+ * stage, so each stage finishes before the next one begins.
+ *
+ * With dependencies, the first executable in sorted order whose
+ * dependencies have succeeded is started next.
+ *
+ * Timeouts are handled by sleeping in epoll no longer than the nearest
+ * deadline, so healthy children cost us no extra wakeups.
+ */
+static int run(sequence_t *seq, const char *dirname, name_t *names,
+        size_t count, char **args)
+{
+    run_t run = { 0 };
+
+    sigset_t chld;
+
+    size_t i;
+
+    run.dirname = dirname;
+    run.names = names;
+    run.args = args;
+    run.count = count;
+    run.failed = count;
+
+    if (seq->depends) {
+        run.entries = depends_scan(seq, names, count);
+        if (!run.entries) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    run.children = calloc(seq->jobs, sizeof(child_t));
+    if (seq->summary || seq->keepgoing) {
+        run.results = calloc(count + 1, sizeof(result_t));
+    }
+    run.bufsize = RELAY_SIZE;
+    run.buf = malloc(run.bufsize);
+    if (!run.children || !run.buf ||
+            ((seq->summary || seq->keepgoing) && !run.results)) {
+        notice(seq, "Out of memory");
+        return EXIT_FAILURE;
+    }
+
+    run.sigfd = -1;
+    run.logfd = -1;
+    run.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (run.epfd == -1) {
+        notice(seq, "Could not create epoll: %s",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Clear any inherited settings */
+    signal(SIGCHLD, SIG_DFL);
+
+    if (seq->total) {
+        run.deadline = monotonic() + seq->total;
+    }
+
+    /* SIGCHLD is only ever read from the signalfd */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+
+    /* and so are the signals we pass on to process groups of their own */
+    if (seq->timeout || seq->total) {
+
+        sigaddset(&chld, SIGINT);
+        sigaddset(&chld, SIGTERM);
+        sigaddset(&chld, SIGHUP);
+
+        if (signals(seq, &run, &chld)) {
+            return EXIT_FAILURE;
+        }
+
+        /*
+         * Running one at a time, each child may have the terminal while
+         * it runs, and we must be able to take it back.
+         */
+        seq->foreground = seq->jobs == 1 &&
+                tcgetpgrp(STDIN_FILENO) == getpgrp();
+        if (seq->foreground) {
+            sigaddset(&chld, SIGTTOU);
+        }
+    }
+
+    sigprocmask(SIG_BLOCK, &chld, &seq->mask);
+
+    while (1) {
+
+        struct epoll_event events[EPOLL_EVENTS];
+
+        int n, e, timeout;
+
+        start(seq, &run);
+
+        if (!run.running) {
+            break;
+        }
+
+        timeout = timeouts(seq, &run);
+
+        if (seq->slog) {
+            log_backlog(seq, &run);
+        }
+
+        checkpoint_sync(seq);
+
+        n = epoll_wait(run.epfd, events, EPOLL_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            notice(seq, "epoll_wait failed: %s",
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        for (e = 0; e < n; e++) {
+
+            uint64_t token = events[e].data.u64;
+
+            child_t *child;
+
+            /* syslog has room for the lines that are waiting */
+            if (token == TOKEN_SYSLOG) {
+                log_flush(seq, 0);
+                continue;
+            }
+
+            /* a child without a pidfd exited, find out which */
+            if (token == TOKEN_SIGNAL) {
+
+                struct signalfd_siginfo si;
+
+                int sig = 0;
+
+                while (read(run.sigfd, &si, sizeof(si)) > 0) {
+                    if (si.ssi_signo != SIGCHLD) {
+                        sig = si.ssi_signo;
+                    }
+                }
+
+                if (sig) {
+                    interrupt(seq, &run, sig);
+                }
+
+                /*
+                 * A child may have been reaped as it was watched, and if
+                 * it has no pipe, nothing else will finish it.
+                 */
+                for (i = 0; i < seq->jobs; i++) {
+                    child = &run.children[i];
+                    if (child->pid && child->pidfd == -1 &&
+                            (child->reaped || reap(child))) {
+                        finish(seq, &run, child);
+                    }
+                }
+
+                continue;
+            }
+
+            child = &run.children[token >> TOKEN_SHIFT];
+
+            /* already finished earlier in this batch */
+            if (!child->pid) {
+                continue;
+            }
+
+            if ((token & TOKEN_MASK) == TOKEN_PIDFD) {
+                if (!child->reaped && reap(child)) {
+                    epoll_ctl(run.epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+                }
+            }
+            else if ((token & TOKEN_MASK) == TOKEN_STDOUT) {
+                if (child->outfd != -1) {
+                    drain_stdout(&run, child);
+                }
+            }
+            else if (child->fd != -1) {
+                drain(seq, &run, child);
+            }
+
+            finish(seq, &run, child);
+        }
+
+    }
+
+    sigprocmask(SIG_SETMASK, &seq->mask, NULL);
+
+    if (run.expired) {
+        run.result = EXIT_TIMEOUT;
+    }
+
+    if (seq->cachefd != -1) {
+        cache_trim(seq);
+    }
+
+    if (seq->slog) {
+
+        log_flush(seq, 1);
+
+        if (seq->logq) {
+            seq->logdropped += seq->logq->count;
+        }
+
+        if (seq->logdropped) {
+            notice(seq, "Could not send %ld lines to syslog", seq->logdropped);
+        }
+    }
+
+    /* all done, the next run starts from the top */
+    if (seq->checkpointfd != -1) {
+        if (run.result == EXIT_SUCCESS && ftruncate(seq->checkpointfd, 0)) {
+            notice(seq, "Could not truncate '%s': %s",
+                    seq->checkpoint, strerror(errno));
+        }
+        seq->dirty = 1;
+        checkpoint_sync(seq);
+    }
+
+    if (run.sigfd != -1) {
+        close(run.sigfd);
+    }
+    close(run.epfd);
+
+    args[0] = NULL;
+
+    if (seq->summary) {
+        summary(seq, &run);
+    }
+
+    /* the exit records already say what failed */
+    if (seq->keepgoing && seq->output == OUTPUT_TEXT) {
+        failures(seq, &run);
+    }
+
+    free(run.results);
+    free(run.buf);
+
+    if (run.entries) {
+        for (i = 0; i < count; i++) {
+            free(run.entries[i].after);
+        }
+        free(run.entries);
+    }
+
+    free(run.children);
+
+    return run.result;
+}
+
+/*
+ * Should we keep this directory entry?
+ *
+ * Dot files are never kept. When ignoring non executables, anything the
+ * directory says is not a regular file is dropped without a stat(), and
+ * only links and entries of unknown type are looked at more closely.
+ */
+static int scan_keep(sequence_t *seq, int dfd, const char *name,
+        unsigned char type)
+{
+    struct stat st;
+
+    /* ignore dot files */
+    if (name[0] == '.') {
+        return 0;
+    }
+
+    if (!seq->ignore) {
+        return 1;
+    }
+
+    switch (type) {
+    case DT_REG:
+        return 1;
+    case DT_LNK:
+    case DT_UNKNOWN:
+        return !fstatat(dfd, name, &st, 0) && S_ISREG(st.st_mode);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Read the names in the directory.
+ *
+ * Where we can, we ask the kernel for large batches of entries with
+ * getdents64(), rather than going through readdir() one at a time.
+ */
+static int scan(sequence_t *seq, int dfd, const char *dirname,
+        table_t *table)
+{
+    size_t dirlen = strlen(dirname);
+
+#if defined(HAVE_GETDENTS64) || defined(SYS_getdents64)
+
+    char *buf = malloc(SCAN_SIZE);
+
+    if (!buf) {
+        notice(seq, "Out of memory");
+        return -1;
+    }
+
+    while (1) {
+
+        long n, pos;
+
+#ifdef HAVE_GETDENTS64
+        n = getdents64(dfd, buf, SCAN_SIZE);
+#else
+        n = syscall(SYS_getdents64, dfd, buf, SCAN_SIZE);
+#endif
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            notice(seq, "Could not read directory '%s': %s", dirname,
+                    strerror(errno));
+            free(buf);
+            return -1;
+        }
+
+        for (pos = 0; pos < n;) {
+
+            dirent64_t *de = (dirent64_t *)(buf + pos);
+
+            pos += de->d_reclen;
+
+            if (!scan_keep(seq, dfd, de->d_name, de->d_type)) {
+                continue;
+            }
+
+            if (table_add(table, dirname, dirlen, de->d_name)) {
+                notice(seq, "Out of memory");
+                free(buf);
+                return -1;
+            }
+        }
+    }
+
+    free(buf);
+
+#else
+
+    struct dirent *de;
+
+    DIR *dh;
+
+    int fd = dup(dfd);
+
+    dh = fd == -1 ? NULL : fdopendir(fd);
+    if (!dh) {
+        notice(seq, "Could not open directory '%s': %s",
                 dirname, strerror(errno));
-        return EXIT_FAILURE;
+        return -1;
+    }
+
+    while ((de = readdir(dh))) {
+
+        if (!scan_keep(seq, dfd, de->d_name, de->d_type)) {
+            continue;
+        }
+
+        if (table_add(table, dirname, dirlen, de->d_name)) {
+            notice(seq, "Out of memory");
+            closedir(dh);
+            return -1;
+        }
+    }
+
+    closedir(dh);
+
+#endif
+
+    return 0;
+}
+
+
+#ifdef HAVE_IO_URING
+
+typedef struct ring_t {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq;
+    void *cq;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+} ring_t;
+
+static void ring_close(ring_t *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq && ring->cq != ring->sq) {
+        munmap(ring->cq, ring->cq_len);
+    }
+    if (ring->sq) {
+        munmap(ring->sq, ring->sq_len);
+    }
+    close(ring->fd);
+}
+
+static int ring_open(ring_t *ring)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(ring_t));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = syscall(SYS_io_uring_setup, PROBE_RING, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->entries = p.sq_entries;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len) {
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
     }
 
-    if (fchdir(dfd) == -1) {
-        fprintf(stderr, "%s: Could not chdir to '%s': %s\n", name,
-                dirname, strerror(errno));
-        return EXIT_FAILURE;
-    }
+    ring->sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq == MAP_FAILED) {
+        ring->sq = NULL;
+        ring_close(ring);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq = ring->sq;
+    }
+    else {
+        ring->cq = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq == MAP_FAILED) {
+            ring->cq = NULL;
+            ring_close(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        ring_close(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+/*
+ * Check the executables with statx() through io_uring, a ring full at
+ * a time, so that a slow filesystem is waited on once for each batch
+ * rather than once for each executable.
+ */
+static int probe_ring(prober_t *pr)
+{
+    struct statx *stx;
+
+    ring_t ring;
+
+    size_t done;
+
+    if (ring_open(&ring)) {
+        return -1;
+    }
+
+    stx = malloc(ring.entries * sizeof(struct statx));
+    if (!stx) {
+        ring_close(&ring);
+        return -1;
+    }
+
+    for (done = 0; done < pr->count; ) {
+
+        unsigned batch = pr->count - done < ring.entries ?
+                pr->count - done : ring.entries;
+        unsigned tail = *ring.sq_tail, reaped = 0, i;
+
+        for (i = 0; i < batch; i++) {
+
+            unsigned idx = (tail + i) & *ring.sq_mask;
+
+            struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = pr->dfd;
+            sqe->addr = (uintptr_t)pr->names[done + i].name;
+            sqe->len = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID;
+            sqe->off = (uintptr_t)&stx[i];
+            sqe->user_data = i;
+
+            ring.sq_array[idx] = idx;
+        }
+
+        __atomic_store_n(ring.sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+        while (reaped < batch) {
+
+            unsigned submit = tail + batch -
+                    __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+            unsigned head, end;
+
+            if (syscall(SYS_io_uring_enter, ring.fd, submit, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                free(stx);
+                ring_close(&ring);
+                return -1;
+            }
+
+            head = *ring.cq_head;
+            end = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+            for (; head != end; head++, reaped++) {
+
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+                probe_t *probe = &pr->probes[done + cqe->user_data];
+
+                /* a kernel too old to know statx over io_uring */
+                if (cqe->res == -EINVAL) {
+                    free(stx);
+                    ring_close(&ring);
+                    return -1;
+                }
+
+                probe->error = cqe->res < 0 ? -cqe->res : 0;
+                probe->mode = stx[cqe->user_data].stx_mode;
+                probe->uid = stx[cqe->user_data].stx_uid;
+                probe->gid = stx[cqe->user_data].stx_gid;
+            }
+
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        done += batch;
+    }
+
+    free(stx);
+    ring_close(&ring);
+
+    return 0;
+}
+
+#endif
+
+/*
+ * Check executables with fstatat() until there are none left. Each of
+ * the threads in the pool runs this, taking the next executable as
+ * they go.
+ */
+static void *probe_stat(void *arg)
+{
+    prober_t *pr = arg;
+
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&pr->next, 1, __ATOMIC_RELAXED)) <
+            pr->count) {
+
+        probe_t *probe = &pr->probes[i];
+
+        struct stat st;
+
+        if (fstatat(pr->dfd, pr->names[i].name, &st, 0)) {
+            probe->error = errno;
+            continue;
+        }
+
+        probe->error = 0;
+        probe->mode = st.st_mode;
+        probe->uid = st.st_uid;
+        probe->gid = st.st_gid;
+    }
+
+    return NULL;
+}
+
+/*
+ * Is the directory on a filesystem where each lookup may cost a round
+ * trip to somewhere else? Where we cannot tell, we assume it might be.
+ */
+static int probe_remote(int dfd)
+{
+#ifdef HAVE_LINUX_MAGIC_H
+    struct statfs sfs;
+
+    if (fstatfs(dfd, &sfs)) {
+        return 1;
+    }
+
+    switch ((unsigned long)sfs.f_type) {
+    case NFS_SUPER_MAGIC:
+    case FUSE_SUPER_MAGIC:
+    case SMB_SUPER_MAGIC:
+    case CIFS_SUPER_MAGIC:
+    case SMB2_SUPER_MAGIC:
+    case CEPH_SUPER_MAGIC:
+    case V9FS_MAGIC:
+    case AFS_SUPER_MAGIC:
+    case AFS_FS_MAGIC:
+        return 1;
+    default:
+        return 0;
+    }
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Look up the type, mode and owner of each executable in the table, all
+ * at once. We prefer io_uring, then a pool of threads, and finally one
+ * after the other. The results land in the same order as the table.
+ */
+static void probe(int dfd, table_t *table, probe_t *probes)
+{
+    prober_t pr = { 0 };
+
+#ifdef HAVE_PTHREAD
+    pthread_t threads[PROBE_THREADS];
+    size_t i, started = 0;
+#endif
+
+    pr.dfd = dfd;
+    pr.names = table->names;
+    pr.probes = probes;
+    pr.count = table->count;
+
+#ifdef HAVE_IO_URING
+    if (!probe_ring(&pr)) {
+        return;
+    }
+#endif
+
+#ifdef HAVE_PTHREAD
+    for (i = 0; i < PROBE_THREADS && i < pr.count; i++) {
+        if (pthread_create(&threads[started], NULL, probe_stat, &pr)) {
+            break;
+        }
+        started++;
+    }
+#endif
+
+    /* we help out, and if there are no threads, do it all */
+    probe_stat(&pr);
+
+#ifdef HAVE_PTHREAD
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+}
+
+/*
+ * Would we be allowed to run this executable? The check made by
+ * faccessat() with AT_EACCESS, worked out from what we already know.
+ */
+static int probe_allowed(const probe_t *probe, const gid_t *groups,
+        int ngroups)
+{
+    uid_t euid = geteuid();
+
+    int i;
+
+    if (probe->error || !S_ISREG(probe->mode)) {
+        return 0;
+    }
+
+    if (!euid) {
+        return (probe->mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+    }
+
+    if (probe->uid == euid) {
+        return (probe->mode & S_IXUSR) != 0;
+    }
+
+    if (probe->gid == getegid()) {
+        return (probe->mode & S_IXGRP) != 0;
+    }
+
+    for (i = 0; i < ngroups; i++) {
+        if (probe->gid == groups[i]) {
+            return (probe->mode & S_IXGRP) != 0;
+        }
+    }
+
+    return (probe->mode & S_IXOTH) != 0;
+}
+
+int main (int argc, char **argv)
+{
+    const char *name = argv[0];
+    const char *basename = NULL;
+    const char *dirname;
+    int c, zero = 0, print = 0, bfd, dfd;
+
+    sequence_t seq = { 0 };
+
+    size_t i;
+
+    table_t table = { 0 };
+
+    bucket_t bucket = { 0 };
+
+    struct stat st;
+
+    probe_t *probes = NULL;
+
+    gid_t *groups = NULL;
+
+    int rv, ngroups = 0, noexec = 0;
+
+    seq.name = name;
+    seq.checkpointfd = -1;
+    seq.cachefd = -1;
+    seq.manifestfd = -1;
+    seq.logfd = -1;
+    seq.logsocket = NULL;
+    seq.bucket = &bucket;
+    seq.idle = MULTILINE_IDLE;
+    seq.recordsize = MULTILINE_SIZE;
+    seq.ttl = 3600 * NANOSECONDS;
+    seq.cachesize = 1024 * 1024;
+    seq.grace = 5 * NANOSECONDS;
+#ifdef HAVE_CLONE
+    seq.backend = SPAWN_CLONE;
+#endif
+
+    while ((c = getopt_long(argc, argv, "0b:dij:kpSs:thv", long_options, NULL)) != -1) {
+
+        switch (c)
+        {
+        case '0':
+            zero = 1;
+
+            break;
+        case 'b':
+            basename = optarg;
+
+            break;
+        case 'd':
+            seq.depends = 1;
 
-    dh = fdopendir(dfd);
-    if (!dh) {
-        fprintf(stderr, "%s: Could not open directory '%s': %s\n", name,
-                dirname, strerror(errno));
-        return EXIT_FAILURE;
-    }
+            break;
+        case 'i':
+            seq.ignore = 1;
 
-    while ((de = readdir(dh))){
+            break;
+        case 'j': {
+            char *end;
+            long jobs;
 
-        /* ignore dot files */
-        if (de->d_name[0] == '.') {
-            continue;
+            errno = 0;
+            jobs = strtol(optarg, &end, 10);
+            if (errno || end == optarg || *end || jobs < 1) {
+                fprintf(stderr, "%s: Jobs must be a positive number: %s\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
+
+            seq.jobs = jobs;
+
+            break;
         }
+        case 'k':
+            seq.keepgoing = 1;
 
-        if (size <= count) {
-            size *= 2;
-            names = realloc(names, size * sizeof(const char *));
+            break;
+        case 'p':
+            print = 1;
+
+            break;
+        case 'S':
+            seq.stages = 1;
+
+            break;
+        case 's':
+        case OPT_JOURNAL: {
+            char *s;
+
+            s = strchr(optarg, '.');
+            if (s) {
+                *s = '\0';
+
+                seq.facility = syslog_decode(optarg, facilitynames);
+                if (seq.facility < 0) {
+                    char *facilities = syslog_details(name, facilitynames);
+                    fprintf(stderr, "%s: Unknown facility '%s': %s\n",
+                            name, optarg, facilities);
+                    free(facilities);
+                    return EXIT_FAILURE;
+                }
+
+                optarg = ++s;
+            }
+            else {
+                seq.facility = LOG_USER;
+            }
+
+            seq.level = syslog_decode(optarg, prioritynames);
+            if (seq.level < 0) {
+                char *priorities = syslog_details(name, prioritynames);
+                fprintf(stderr, "%s: Unknown priority %s: %s\n",
+                        name, optarg, priorities);
+                free(priorities);
+                return EXIT_FAILURE;
+            }
+
+            seq.slog = 1;
+            seq.journald = (c == OPT_JOURNAL);
+
+            break;
         }
+        case 't':
+            seq.summary = 1;
 
-        names[count] = strdup(de->d_name);
+            break;
+        case OPT_TIMEOUT:
+        case OPT_TOTAL_TIMEOUT:
+        case OPT_KILL_AFTER: {
+            long long ns;
 
-        count++;
-    }
+            if (parse_seconds(optarg, &ns)) {
+                fprintf(stderr, "%s: Timeout must be a positive number of seconds: %s\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-    closedir(dh);
+            if (c == OPT_TIMEOUT) {
+                seq.timeout = ns;
+            }
+            else if (c == OPT_TOTAL_TIMEOUT) {
+                seq.total = ns;
+            }
+            else {
+                seq.grace = ns;
+            }
 
-    qsort(names, count, sizeof(const char *), sort_strcmp);
+            break;
+        }
+        case OPT_SUMMARY_FORMAT:
+            if (!strcmp(optarg, "table")) {
+                seq.format = SUMMARY_TABLE;
+            }
+            else if (!strcmp(optarg, "tsv")) {
+                seq.format = SUMMARY_TSV;
+            }
+            else {
+                fprintf(stderr, "%s: Unknown summary format '%s'\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
+            seq.summary = 1;
 
-    for (i = 0; i < count; i++) {
+            break;
+        case OPT_CHECKPOINT:
+            seq.checkpoint = optarg;
 
-        char *buf = malloc(dirlen + strlen(names[i]) + 2);
+            break;
+        case OPT_RESUME:
+            seq.resume = 1;
 
-        sprintf(buf, "%s/%s", dirname, names[i]);
+            break;
+        case OPT_CACHE:
+            seq.cache = optarg;
 
-        argv[optind] = buf;
+            break;
+        case OPT_CACHE_TTL: {
+            if (parse_seconds(optarg, &seq.ttl)) {
+                fprintf(stderr, "%s: Cache TTL must be a positive number of seconds: %s\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-        if (print) {
+            break;
+        }
+        case OPT_CACHE_SIZE: {
+            char *end;
+            unsigned long long size;
 
-            if (ignore) {
+            errno = 0;
+            size = strtoull(optarg, &end, 10);
+            if (errno || end == optarg || *end || !size || size > SSIZE_MAX) {
+                fprintf(stderr, "%s: Cache size must be a positive number of bytes: %s\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-                struct stat buf;
+            seq.cachesize = size;
 
-                if (fstatat(dfd, names[i], &buf, 0)) {
-                    continue;
-                }
+            break;
+        }
+        case OPT_CACHE_ENV: {
+            const char **env = realloc(seq.cacheenv,
+                    (seq.ncacheenv + 1) * sizeof(const char *));
+            if (!env) {
+                fprintf(stderr, "%s: Out of memory\n", name);
+                return EXIT_FAILURE;
+            }
 
-                if (!S_ISREG(buf.st_mode)) {
-                    continue;
-                }
+            seq.cacheenv = env;
+            seq.cacheenv[seq.ncacheenv++] = optarg;
 
-                if (faccessat(dfd, names[i], X_OK, AT_EACCESS)) {
-                    continue;
-                }
+            break;
+        }
+        case OPT_SORT:
+            if (!strcmp(optarg, "bytes")) {
+                seq.sort = SORT_BYTES;
+            }
+            else if (!strcmp(optarg, "natural")) {
+                seq.sort = SORT_NATURAL;
+            }
+            else if (!strcmp(optarg, "version")) {
+                seq.sort = SORT_VERSION;
+            }
+            else if (!strcmp(optarg, "locale")) {
+                seq.sort = SORT_LOCALE;
+                setlocale(LC_COLLATE, "");
+            }
+            else {
+                fprintf(stderr, "%s: Unknown sort order '%s'\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
+
+            break;
+        case OPT_MANIFEST:
+            seq.manifest = optarg;
+
+            break;
+        case OPT_RAW:
+            seq.raw = 1;
+
+            break;
+        case OPT_SYSLOG_SOCKET:
+            seq.logsocket = optarg;
+
+            break;
+        case OPT_RATE_LIMIT:
+        case OPT_TOTAL_RATE_LIMIT: {
+            long lines, bytes;
 
+            if (parse_rate(optarg, &lines, &bytes)) {
+                fprintf(stderr, "%s: Rate limit must be lines[,bytes] per second: %s\n",
+                        name, optarg);
+                return EXIT_FAILURE;
             }
 
-            if (zero) {
-                fprintf(stdout, "%s%c", buf, 0);
+            if (c == OPT_RATE_LIMIT) {
+                seq.ratelines = lines;
+                seq.ratebytes = bytes;
             }
             else {
-                fprintf(stdout, "%s\n", buf);
+                seq.totallines = lines;
+                seq.totalbytes = bytes;
             }
 
+            break;
         }
+        case OPT_MULTILINE:
+            seq.multiline = 1;
 
-        else {
-
-            int errpair[2];
+            break;
+        case OPT_MULTILINE_START: {
+            regex_t *starts;
+            int rv;
 
-            pid_t w, f;
+            starts = realloc(seq.starts, (seq.nstarts + 1) * sizeof(regex_t));
+            if (!starts) {
+                fprintf(stderr, "%s: Out of memory\n", name);
+                return EXIT_FAILURE;
+            }
+            seq.starts = starts;
 
-            if (pipe(errpair)) {
-                fprintf(stderr, "%s: Could not create pipe: %s", name,
-                        strerror(errno));
+            rv = regcomp(&seq.starts[seq.nstarts], optarg,
+                    REG_EXTENDED | REG_NOSUB);
+            if (rv) {
+                char err[256];
 
+                regerror(rv, &seq.starts[seq.nstarts], err, sizeof(err));
+                fprintf(stderr, "%s: Bad start pattern '%s': %s\n",
+                        name, optarg, err);
                 return EXIT_FAILURE;
             }
 
-            /* Clear any inherited settings */
-            signal(SIGCHLD, SIG_DFL);
+            seq.nstarts++;
+            seq.multiline = 1;
 
-            f = fork();
+            break;
+        }
+        case OPT_MULTILINE_IDLE:
+            if (parse_seconds(optarg, &seq.idle)) {
+                fprintf(stderr, "%s: Idle time must be a positive number of seconds: %s\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-            /* error */
-            if (f < 0) {
-                fprintf(stderr, "%s: Could not fork: %s", name,
-                        strerror(errno));
+            break;
+        case OPT_MULTILINE_SIZE: {
+            char *end;
+            long size;
 
+            errno = 0;
+            size = strtol(optarg, &end, 10);
+            if (errno || end == optarg || *end || size < 1 || size > RELAY_LINE) {
+                fprintf(stderr, "%s: Record size must be a positive number of bytes: %s\n",
+                        name, optarg);
                 return EXIT_FAILURE;
             }
 
-            /* child */
-            else if (f == 0) {
+            seq.recordsize = size;
+
+            break;
+        }
+        case OPT_COLLAPSE:
+            seq.collapse = 1;
 
-                dup2(errpair[WRITE_FD], STDERR_FILENO);
-                close(errpair[READ_FD]);
-                close(errpair[WRITE_FD]);
+            break;
+        case OPT_TIMESTAMPS:
+            if (!strcmp(optarg, "mono")) {
+                seq.timestamps = TIMESTAMPS_MONO;
+            }
+            else if (!strcmp(optarg, "real")) {
+                seq.timestamps = TIMESTAMPS_REAL;
+            }
+            else if (!strcmp(optarg, "delta")) {
+                seq.timestamps = TIMESTAMPS_DELTA;
+            }
+            else {
+                fprintf(stderr, "%s: Unknown timestamps '%s'\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-                execv(names[i], argv + optind);
+            break;
+        case OPT_OUTPUT_FORMAT:
+            if (!strcmp(optarg, "text")) {
+                seq.output = OUTPUT_TEXT;
+            }
+            else if (!strcmp(optarg, "ndjson")) {
+                seq.output = OUTPUT_NDJSON;
+            }
+            else if (!strcmp(optarg, "frames")) {
+                seq.output = OUTPUT_FRAMES;
+            }
+            else {
+                fprintf(stderr, "%s: Unknown output format '%s'\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-                if (ignore && errno == EACCES) {
-                    return EXIT_SUCCESS;
-                }
+            break;
+        case OPT_SYSLOG_FORMAT:
+            if (!strcmp(optarg, "rfc3164")) {
+                seq.logformat = SYSLOG_RFC3164;
+            }
+            else if (!strcmp(optarg, "rfc5424")) {
+                seq.logformat = SYSLOG_RFC5424;
+            }
+            else {
+                fprintf(stderr, "%s: Unknown syslog format '%s'\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-                fprintf(stderr, "%s: Could not execute '%s': %s\n", name,
-                        argv[optind], strerror(errno));
+            break;
+        case OPT_PIPE_SIZE: {
+            char *end;
+            long size;
 
+            errno = 0;
+            size = strtol(optarg, &end, 10);
+            if (errno || end == optarg || *end || size < 1 || size > INT_MAX) {
+                fprintf(stderr, "%s: Pipe size must be a positive number of bytes: %s\n",
+                        name, optarg);
                 return EXIT_FAILURE;
             }
 
-            /* parent */
+            seq.pipesize = size;
+
+            break;
+        }
+        case OPT_SPAWN:
+            if (!strcmp(optarg, "fork")) {
+                seq.backend = SPAWN_FORK;
+            }
+#ifdef HAVE_CLONE
+            else if (!strcmp(optarg, "clone")) {
+                seq.backend = SPAWN_CLONE;
+            }
+#endif
             else {
+                fprintf(stderr, "%s: Unknown spawn method '%s'\n",
+                        name, optarg);
+                return EXIT_FAILURE;
+            }
 
-                /* read our child's stderr, redirect to syslog or prefix with script name */
-                close(errpair[WRITE_FD]);
+            break;
+        case 'h':
+            return help(name, NULL, 0);
 
-                if (slog) {
-                    openlog(argv[optind], LOG_PID, facility);
-                }
+        case 'v':
+            return version();
 
-                while (1) {
+        default:
+            return help(name, NULL, EXIT_FAILURE);
 
-                    char errbuf[1024];
+        }
 
-                    int i, s = 0;
+    }
 
-                    int n = read(errpair[READ_FD], errbuf, sizeof(errbuf));
-                    if (n <= 0) {
-                        break;
-                    }
+    if (optind == argc) {
+        fprintf(stderr, "%s: No directory specified.\n", name);
+        return EXIT_FAILURE;
+    }
 
-                    /* syslog/prefix all LF terminated strings */
-                    for (i = 0; i < n; i++) {
-                        if (errbuf[i] == '\n') {
-                            if (slog) {
-                                syslog(level, "%.*s\n", i - s, errbuf + s);
-                            }
-                            else {
-                                fprintf(stderr, "%s: %.*s\n", argv[optind], i - s, errbuf + s);
-                            }
-                            s = i + 1;
-                        }
-                    }
+    if (seq.stages && seq.depends) {
+        fprintf(stderr, "%s: Stages and dependencies cannot be combined.\n", name);
+        return EXIT_FAILURE;
+    }
 
-                    /* syslog/prefix any overflow */
-                    if (s < n) {
-                        if (slog) {
-                            syslog(level, "%.*s\n", i - s, errbuf + s);
-                        }
-                        else {
-                            fprintf(stderr, "%s: %.*s\n", argv[optind], i - s, errbuf + s);
-                        }
-                    }
+    if (seq.raw && (seq.slog || seq.cache || seq.timestamps || seq.collapse ||
+            seq.multiline ||
+            seq.ratelines || seq.ratebytes || seq.totallines || seq.totalbytes)) {
+        fprintf(stderr, "%s: Raw output cannot be sent to syslog, cached, timestamped or limited.\n",
+                name);
+        return EXIT_FAILURE;
+    }
 
-                }
+    if (seq.output != OUTPUT_TEXT && (seq.raw || seq.slog || seq.summary)) {
+        fprintf(stderr, "%s: Output formats cannot be combined with raw output, syslog or a summary.\n",
+                name);
+        return EXIT_FAILURE;
+    }
 
-                if (slog) {
-                    closelog();
-                }
+    if (seq.resume && !seq.checkpoint) {
+        fprintf(stderr, "%s: Resume needs a checkpoint file.\n", name);
+        return EXIT_FAILURE;
+    }
 
-                close(errpair[READ_FD]);
+    /* opened before we change directory, as the path is ours */
+    if (seq.checkpoint && !print && checkpoint_open(&seq)) {
+        return EXIT_FAILURE;
+    }
 
-                /* wait for the child process to be done */
-                do {
-                    w = waitpid(f, &status, 0);
-                    if (w == -1 && errno != EINTR) {
-                        break;
-                    }
-                } while (w != f);
+    /* connected before we change directory, as the path is ours */
+    if (seq.slog && !print) {
 
-                /* waitpid failed, we give up */
-                if (w == -1) {
+        if (!seq.logsocket) {
+            seq.logsocket = seq.journald ? JOURNAL_SOCKET : SYSLOG_SOCKET;
+        }
 
-                    fprintf(stderr, "%s: waitpid for '%s' failed: %s\n", name,
-                            argv[optind], strerror(errno));
+        if (seq.journald) {
+            log_runid(&seq);
+        }
 
-                    return EXIT_FAILURE;
-                }
+        /* we may need to connect again from elsewhere */
+        if (seq.logsocket[0] != '/') {
+            char cwd[PATH_MAX], *path;
 
-                /* process successful exit */
-                else if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+            if (getcwd(cwd, sizeof(cwd)) &&
+                    (path = malloc(strlen(cwd) + strlen(seq.logsocket) + 2))) {
+                sprintf(path, "%s/%s", cwd, seq.logsocket);
+                seq.logsocket = path;
+            }
+        }
 
-                    /* drop through */
-                }
+        if (log_connect(&seq)) {
+            notice(&seq, "Could not connect to '%s': %s", seq.logsocket,
+                    strerror(errno));
+        }
 
-                /* process non success exit */
-                else if (WIFEXITED(status)) {
+        if (gethostname(seq.hostname, sizeof(seq.hostname) - 1) ||
+                !seq.hostname[0]) {
+            strcpy(seq.hostname, "-");
+        }
+    }
 
-                    fprintf(stderr, "%s: %s returned %d\n", name,
-                            argv[optind], status);
+    if (seq.manifest && manifest_open(&seq)) {
+        return EXIT_FAILURE;
+    }
 
-                    return WEXITSTATUS(status);
-                }
+    if (seq.cache && !print) {
+        seq.cachefd = open(seq.cache, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (seq.cachefd == -1) {
+            notice(&seq, "Could not open cache '%s': %s",
+                    seq.cache, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
 
-                /* process received a signal */
-                else if (WIFSIGNALED(status)) {
+    if (basename) {
 
-                    fprintf(stderr, "%s: %s signaled %d\n", name,
-                            argv[optind], status);
+        bfd = open(basename, O_RDONLY);
+        if (bfd == -1) {
+            notice(&seq, "Could not open '%s': %s",
+                    basename, strerror(errno));
+            return EXIT_FAILURE;
+        }
 
-                    return WTERMSIG(status) + 128;
-                }
+        if (fchdir(bfd) == -1) {
+            notice(&seq, "Could not chdir to '%s': %s",
+                    basename, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
 
-                /* otherwise weirdness, just leave */
-                else {
+    dirname = argv[optind];
 
-                    fprintf(stderr, "%s: %s failed with %d\n", name,
-                            argv[optind], status);
+    dfd = open(dirname, O_RDONLY);
+    if (dfd == -1) {
+        notice(&seq, "Could not open '%s': %s",
+                dirname, strerror(errno));
+        return EXIT_FAILURE;
+    }
 
-                    return EX_OSERR;
-                }
+    if (fchdir(dfd) == -1) {
+        notice(&seq, "Could not chdir to '%s': %s",
+                dirname, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (seq.manifest && fstat(dfd, &st)) {
+        seq.manifest = NULL;
+    }
+
+    /* unless the directory is just as we last saw it, read it again */
+    if (!seq.manifest || manifest_load(&seq, &st, dirname, &table)) {
+
+        if (scan(&seq, dfd, dirname, &table) ||
+                table_sort(&table, seq.sort)) {
+            table_free(&table);
+            return EXIT_FAILURE;
+        }
+
+        if (seq.manifest) {
+            manifest_save(&seq, dfd, &st, &table);
+        }
+
+    }
+
+    if (!seq.jobs) {
+        seq.jobs = (seq.stages || seq.depends) && table.count ? table.count : 1;
+    }
+
+    if (!print) {
+        table_open(&seq, &table, dfd);
+        rv = run(&seq, dirname, table.names, table.count, argv + optind);
+        table_free(&table);
+        return rv;
+    }
+
+    /*
+     * On a network filesystem, look everything up in one go. Locally
+     * the lookups are cheaper than handing them off.
+     */
+    if (seq.ignore && probe_remote(dfd)) {
 
+        struct statvfs vfs;
+
+        probes = calloc(table.count ? table.count : 1, sizeof(probe_t));
+        ngroups = getgroups(0, NULL);
+        groups = malloc((ngroups > 0 ? ngroups : 1) * sizeof(gid_t));
+        if (!probes || !groups) {
+            notice(&seq, "Out of memory");
+            table_free(&table);
+            return EXIT_FAILURE;
+        }
+
+        ngroups = getgroups(ngroups, groups);
+
+        probe(dfd, &table, probes);
+
+        noexec = !fstatvfs(dfd, &vfs) && (vfs.f_flag & ST_NOEXEC);
+    }
+
+    for (i = 0; i < table.count; i++) {
+
+        name_t *n = &table.names[i];
+
+        if (seq.ignore) {
+
+            if (probes ? noexec || !probe_allowed(&probes[i], groups, ngroups) :
+                    faccessat(dfd, n->name, X_OK, AT_EACCESS) != 0) {
+                continue;
             }
 
         }
 
-        free(buf);
+        if (zero) {
+            fprintf(stdout, "%s%c", n->path, 0);
+        }
+        else {
+            fprintf(stdout, "%s\n", n->path);
+        }
 
-        argv[optind] = NULL;
     }
 
+    free(probes);
+    free(groups);
+    table_free(&table);
+
     return EXIT_SUCCESS;
 }